@@ -0,0 +1,326 @@
+#include "octray_node.hpp"
+#include "octray_stats.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Sweeps tree depth, ray count, ray distribution and thread count over batch
+// insertion into a fresh unit Octray, printing one JSON record per run to stdout
+
+namespace
+{
+    enum RayDistribution
+    {
+        SHORT_RAYS,   // random start, up to 2% of the tree size long
+        LONG_RAYS,    // from a shared sensor origin to anywhere, often leaving the tree
+        AXIS_ALIGNED, // long rays parallel to x, y or z
+        DEGENERATE    // zero length, or entirely outside the tree
+    };
+
+    const char *distribution_names[] = {"short", "long", "axis", "degenerate"};
+
+    enum BuildStrategy
+    {
+        PARTITION_BUILD, // accumulate_rays on the pool, workers owning disjoint subtrees of one tree
+        MERGE_BUILD      // a tree per worker from its share of the rays, then Octray::merge_all
+    };
+
+    const char *build_names[] = {"partition", "merge"};
+
+    struct LeafCounter : OctrayVisitor
+    {
+        size_t leaves_visited = 0;
+
+        void on_leaf(const OctreeKey &, const size_t, const int) { leaves_visited++; }
+    };
+
+    // peak_bytes is the most node bytes in use at once: every worker's tree before the merge, or
+    // the merged tree at its own peak
+    Octray::BatchStats merge_build(Octray &octray, const std::vector<RaySegment> &rays, ThreadPool &pool, size_t &peak_bytes)
+    {
+        using namespace std::chrono;
+        time_point start_time = high_resolution_clock::now();
+
+        Octray::BatchStats stats;
+        stats.rays = rays.size();
+        stats.threads = pool.size();
+        stats.tasks = pool.size();
+
+        std::vector<std::unique_ptr<Octray>> trees(pool.size());
+        std::vector<LeafCounter> counters(pool.size());
+        stats.steals = pool.parallel_for(pool.size(), [&](size_t t, size_t)
+                                         {
+            trees[t] = std::make_unique<Octray>(octray.node_center(OctreeKey{}, 0), octray.node_size(0), octray.get_max_depth());
+            size_t begin = rays.size() * t / pool.size();
+            size_t end = rays.size() * (t + 1) / pool.size();
+            for (size_t i = begin; i < end; i += Octray::PACKET_WIDTH)
+                trees[t]->accumulate_ray_packet<Octray::PACKET_WIDTH>(rays.data() + i, std::min(Octray::PACKET_WIDTH, end - i), counters[t]); });
+        peak_bytes = 0;
+        for (const std::unique_ptr<Octray> &tree : trees)
+            peak_bytes += tree->peak_bytes_in_use();
+        Octray::merge_all(trees, pool);
+        octray.merge(std::move(*trees[0]));
+        peak_bytes = std::max(peak_bytes, octray.peak_bytes_in_use());
+
+        for (const LeafCounter &counter : counters)
+            stats.leaves_visited += counter.leaves_visited;
+        stats.seconds = duration<double>(high_resolution_clock::now() - start_time).count();
+        return stats;
+    }
+
+    std::vector<RaySegment> generate_rays(const RayDistribution distribution, const size_t count, const unsigned seed)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> inside(-0.5f, 0.5f);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::normal_distribution<float> normal(0.0f, 1.0f);
+
+        auto random_direction = [&]()
+        {
+            Vec3f dir{normal(rng), normal(rng), normal(rng)};
+            return dir.normalized();
+        };
+
+        std::vector<RaySegment> rays(count);
+        const Vec3f sensor{0.013f, -0.021f, 0.008f};
+        for (size_t i = 0; i < count; i++)
+        {
+            Vec3f start, end;
+            switch (distribution)
+            {
+            case SHORT_RAYS:
+                start = {inside(rng), inside(rng), inside(rng)};
+                end = start + random_direction() * (0.02f * unit(rng));
+                break;
+            case LONG_RAYS:
+                start = sensor;
+                end = sensor + random_direction() * (0.3f + 0.6f * unit(rng));
+                break;
+            case AXIS_ALIGNED:
+            {
+                start = {inside(rng), inside(rng), inside(rng)};
+                end = start;
+                float length = (unit(rng) < 0.5f ? -1.0f : 1.0f) * (0.3f + 0.6f * unit(rng));
+                int axis = static_cast<int>(i % 3);
+                (axis == 0 ? end.x : axis == 1 ? end.y : end.z) += length;
+                break;
+            }
+            case DEGENERATE:
+                start = {inside(rng), inside(rng), inside(rng)};
+                end = start;
+                if (i % 2)
+                {
+                    start.x += 2.0f;
+                    end = start + random_direction() * 0.4f;
+                }
+                break;
+            }
+            rays[i] = {start, end};
+        }
+        return rays;
+    }
+
+    // A kB field of /proc/self/status, such as VmRSS or VmHWM; -1 where there is none
+    long status_kb(const char *field)
+    {
+        const size_t length = std::strlen(field);
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, length, field) == 0 && line.size() > length && line[length] == ':')
+                return std::atol(line.c_str() + length + 1);
+        }
+        return -1;
+    }
+
+    // Restarts the process's peak RSS (VmHWM) at its current RSS, so each run reports its own
+    // peak; false where the kernel does not support it
+    bool reset_peak_rss()
+    {
+        std::ofstream clear_refs("/proc/self/clear_refs");
+        clear_refs << "5";
+        clear_refs.flush();
+        return clear_refs.good();
+    }
+
+    // Comma separated decimal values, each in [min, max]; false on anything else
+    bool parse_list(const char *arg, const size_t min, const size_t max, std::vector<size_t> &values)
+    {
+        values.clear();
+        for (const char *p = arg;; p++)
+        {
+            if (*p < '0' || *p > '9')
+                return false;
+            char *next;
+            errno = 0;
+            const unsigned long long value = std::strtoull(p, &next, 10);
+            if (errno || value < min || value > max || (*next && *next != ','))
+                return false;
+            values.push_back(static_cast<size_t>(value));
+            p = next;
+            if (!*p)
+                return true;
+        }
+    }
+
+    // Comma separated names, each exactly one of names; false on anything else
+    bool parse_names(const char *arg, const char *const *names, const size_t name_count, std::vector<size_t> &values)
+    {
+        values.clear();
+        std::string list = arg;
+        size_t begin = 0;
+        while (true)
+        {
+            const size_t end = std::min(list.find(',', begin), list.size());
+            const std::string name = list.substr(begin, end - begin);
+            const auto found = std::find_if(names, names + name_count, [&](const char *candidate)
+                                            { return name == candidate; });
+            if (found == names + name_count)
+                return false;
+            values.push_back(static_cast<size_t>(found - names));
+            if (end == list.size())
+                return true;
+            begin = end + 1;
+        }
+    }
+
+    void print_usage(const char *program)
+    {
+        std::fprintf(stderr,
+                     "usage: %s [--depths 8,10,12] [--rays 10000] [--distributions short,long,axis,degenerate]\n"
+                     "          [--threads 1,N] [--builds partition,merge] [--seed 1]\n",
+                     program);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t hardware_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<size_t> depths = {8, 10, 12};
+    std::vector<size_t> ray_counts = {10000};
+    std::vector<size_t> distributions = {SHORT_RAYS, LONG_RAYS, AXIS_ALIGNED, DEGENERATE};
+    std::vector<size_t> thread_counts = {1};
+    std::vector<size_t> builds = {PARTITION_BUILD};
+    if (hardware_threads > 1)
+        thread_counts.push_back(hardware_threads);
+    unsigned seed = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        bool valid = false;
+        std::vector<size_t> seeds;
+        if (!std::strcmp(argv[i], "--depths") && has_value)
+            valid = parse_list(argv[++i], 1, Octray::MAX_DEPTH_LIMIT, depths);
+        else if (!std::strcmp(argv[i], "--rays") && has_value)
+            valid = parse_list(argv[++i], 1, SIZE_MAX, ray_counts);
+        else if (!std::strcmp(argv[i], "--distributions") && has_value)
+            valid = parse_names(argv[++i], distribution_names, 4, distributions);
+        else if (!std::strcmp(argv[i], "--threads") && has_value)
+            valid = parse_list(argv[++i], 1, SIZE_MAX, thread_counts);
+        else if (!std::strcmp(argv[i], "--builds") && has_value)
+            valid = parse_names(argv[++i], build_names, 2, builds);
+        else if (!std::strcmp(argv[i], "--seed") && has_value)
+        {
+            valid = parse_list(argv[++i], 0, UINT_MAX, seeds) && seeds.size() == 1;
+            seed = valid ? static_cast<unsigned>(seeds[0]) : seed;
+        }
+        if (!valid)
+        {
+            std::fprintf(stderr, "%s: bad argument %s\n", argv[0], argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    std::printf("{\n  \"benchmark\": \"octray_accumulate_rays\",\n  \"hardware_threads\": %zu,\n  \"results\": [", hardware_threads);
+    bool first = true;
+    for (size_t depth : depths)
+    {
+        for (size_t ray_count : ray_counts)
+        {
+            for (size_t distribution : distributions)
+            {
+                std::vector<RaySegment> rays = generate_rays(static_cast<RayDistribution>(distribution), ray_count, seed);
+                for (size_t threads : thread_counts)
+                {
+                    for (size_t build : builds)
+                    {
+                        std::fprintf(stderr, "depth %zu, %zu %s rays, %zu threads, %s build\n", depth, ray_count, distribution_names[distribution], threads,
+                                     build_names[build]);
+
+                        long nodes, peak_slots, final_slots;
+                        size_t bytes, peak_bytes;
+                        long rss_kb, peak_rss_growth_kb = -1;
+                        Octray::BatchStats stats;
+                        OctrayStats::reset();
+                        const bool peak_reset = reset_peak_rss();
+                        const long rss_before_kb = status_kb("VmRSS");
+                        {
+                            Octray octray({0.f, 0.f, 0.f}, 1.f, depth);
+                            ThreadPool pool(threads);
+                            if (build == MERGE_BUILD)
+                                stats = merge_build(octray, rays, pool, peak_bytes);
+                            else
+                            {
+                                stats = octray.accumulate_rays(rays.data(), rays.size(), pool);
+                                peak_bytes = octray.peak_bytes_in_use();
+                            }
+                            nodes = static_cast<long>(octray.subtree_size());
+                            // Node slots of the blocks in use, 8 siblings a block, and the root; children
+                            // are allocated by block, so this is the node memory rather than the node count
+                            peak_slots = static_cast<long>(peak_bytes / sizeof(OctrayNode) + 1);
+                            final_slots = static_cast<long>(octray.bytes_in_use() / sizeof(OctrayNode) + 1);
+                            bytes = octray.bytes_reserved();
+                            // Sampled while the tree and pool are still alive
+                            rss_kb = status_kb("VmRSS");
+                            const long peak_kb = status_kb("VmHWM");
+                            if (peak_reset && peak_kb >= 0 && rss_before_kb >= 0)
+                                peak_rss_growth_kb = peak_kb - rss_before_kb;
+                        }
+
+                        // ns_per_node is wall time per max depth leaf visited by a ray
+                        double rays_per_sec = stats.seconds > 0.0 ? stats.rays / stats.seconds : 0.0;
+                        double ns_per_node = stats.leaves_visited ? stats.seconds * 1e9 / stats.leaves_visited : 0.0;
+                        std::printf("%s\n    {\"depth\": %zu, \"rays\": %zu, \"distribution\": \"%s\", \"threads\": %zu, \"build\": \"%s\", "
+                                    "\"seconds\": %.6f, \"rays_per_sec\": %.1f, \"ns_per_node\": %.2f, \"leaves_visited\": %zu, "
+                                    "\"rays_missed\": %zu, \"final_nodes\": %ld, \"peak_node_slots\": %ld, \"final_node_slots\": %ld, \"tree_bytes\": %zu, \"steals\": %zu, "
+                                    "\"rss_kb\": %ld, \"peak_rss_growth_kb\": %ld",
+                                    first ? "" : ",", depth, ray_count, distribution_names[distribution], threads, build_names[build],
+                                    stats.seconds, rays_per_sec, ns_per_node, stats.leaves_visited,
+                                    stats.rays_missed, nodes, peak_slots, final_slots, bytes, stats.steals,
+                                    rss_kb, peak_rss_growth_kb);
+                        // Hot path counters, only in builds with OCTRAY_ENABLE_STATS
+                        if (OctrayStats::ENABLED)
+                        {
+                            std::printf(", \"stats\": ");
+                            std::fflush(stdout);
+                            OctrayStats::write_json(std::cout, OctrayStats::collect());
+                            std::cout.flush();
+                        }
+                        std::printf("}");
+                        std::fflush(stdout);
+                        first = false;
+                    }
+                }
+            }
+        }
+    }
+    std::printf("\n  ]\n}\n");
+    return 0;
+}
@@ -1,61 +1,66 @@
 #pragma once
 
-#include <array>
-#include <vectors.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <node_arena.hpp>
+#include <octray_stats.hpp>
 
+// Structural part of an octree node: which children exist and where their sibling
+// block lives. Geometry is not stored; traversals derive it from an OctreeKey and
+// the depth they are at.
 template <typename NodeType>
 class BaseOctreeNode
 {
 public:
-    BaseOctreeNode(const Vec3f &_center, const float _size)
-        : parent(nullptr), center(_center), size(_size), depth(0)
-    {
-        children.fill(nullptr);
-    }
+    bool is_leaf() const { return child_mask == 0; }
+    bool has_child(int i) const { return child_mask & (1 << i); }
 
-    virtual ~BaseOctreeNode()
+    // Nodes in this subtree, including this one
+    size_t subtree_size() const
     {
-        if (!leaf)
+        size_t count = 1;
+        for (int i = 0; i < 8; i++)
         {
-            for (auto &child : children)
-            {
-                delete child;
-                child = nullptr;
-            }
+            if (has_child(i))
+                count += child(i)->subtree_size();
         }
+        return count;
     }
 
 protected:
-    BaseOctreeNode(const NodeType *_parent, const Vec3f &_center)
-        : parent(_parent), center(_center), size(_parent->size / 2.f), depth(_parent->depth + 1)
+    // Only valid when has_child(i)
+    NodeType *child(int i) const
     {
-        children.fill(nullptr);
+        return children + i;
     }
 
-    void split()
+    // Children are constructed lazily, one at a time, as rays touch them. The first
+    // one reserves a block for all 8 siblings so they stay contiguous.
+    NodeType *get_or_create_child(int i, NodeArena<NodeType> &arena)
     {
-        leaf = false;
-
-        float quarter_size = size / 4.0f;
-        for (int i = 0; i < 8; i++)
+        if (!children)
         {
-            Vec3f child_center = center;
-            child_center.x += (i & 1 ? quarter_size : -quarter_size);
-            child_center.y += (i & 2 ? quarter_size : -quarter_size);
-            child_center.z += (i & 4 ? quarter_size : -quarter_size);
-
-            children[i] = new NodeType(static_cast<NodeType *>(this), child_center);
+            children = arena.allocate_block();
+            OCTRAY_COUNT(NODES_SPLIT, 1);
+        }
+        if (!has_child(i))
+        {
+            new (children + i) NodeType();
+            child_mask |= 1 << i;
         }
+        return children + i;
     }
 
-protected:
-    bool leaf = true;
-
-    const Vec3f center;
-    const float size;
-
-    const size_t depth;
-    const NodeType *parent;
+    // Drop every child; the caller is responsible for the arena memory
+    void clear_children()
+    {
+        child_mask = 0;
+        children = nullptr;
+    }
 
-    std::array<NodeType *, 8> children;
-};
\ No newline at end of file
+protected:
+    // Slot i of the sibling block holds a constructed child when bit i is set
+    NodeType *children = nullptr;
+    uint8_t child_mask = 0;
+};
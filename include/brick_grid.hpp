@@ -0,0 +1,154 @@
+#pragma once
+
+#include "octray_node.hpp"
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+// Max depth cells of an Octray's geometry kept flat, in a hash map of dense 8x8x8 bricks, with
+// the same keys and log-odds model. A ray is walked cell by cell with a 3D DDA instead of being
+// descended from the root, which for short rays at fixed resolution skips all the inner levels.
+// There is no hierarchy, so no pruning, coarse queries or culling: ingest here, then convert with
+// to_octray() for those and for the file format.
+class BrickGrid
+{
+public:
+    static constexpr int BRICK_BITS = 3;
+    static constexpr size_t BRICK_CELLS = size_t{1} << (3 * BRICK_BITS);
+    // Default cap on the cells BrickGrid(octray) may expand to, about 280 MB of bricks
+    static constexpr size_t MAX_EXPANDED_CELLS = size_t{1} << 26;
+
+    BrickGrid(const Vec3f &_center, const float _size, const size_t _max_depth);
+    // Geometry, parameters and every known cell of octray, a pruned node filling all its cells.
+    // A node pruned d levels above max depth becomes 8^d cells, so a coarse map can expand
+    // enormously: throws std::length_error, before storing anything, if the cells would number
+    // more than max_cells.
+    explicit BrickGrid(const Octray &octray, const size_t max_cells = MAX_EXPANDED_CELLS);
+
+    // Applies to later updates only. Throws std::invalid_argument unless clamp_min < 0 < clamp_max,
+    // hit > 0 and miss < 0.
+    void set_occupancy_params(const Octray::OccupancyParams &params);
+    const Octray::OccupancyParams &get_occupancy_params() const { return occupancy; }
+
+    // Updates the cell the end point is in, if it is inside the grid, as a hit and every other cell
+    // on the segment as a miss. The path is 6-connected, so cells the segment only grazes at an edge
+    // or corner are left alone where Octray's descent would update them.
+    void accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end);
+
+    // As above, calling visitor.on_leaf for every cell updated; there are no misses to report
+    template <typename Visitor>
+    void accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end, Visitor &visitor);
+
+    void accumulate_rays(const RaySegment *rays, const size_t count);
+
+    // Log odds of the max depth cell, nullptr if it is outside the grid or no ray has crossed it
+    const float *find(const OctreeKey &key) const;
+    const float *search(const Vec3f &point) const;
+    bool is_occupied(const float log_odds) const { return log_odds > occupancy.occupied_threshold; }
+
+    // Calls visit(code, log_odds) for every known cell, in ascending morton code order
+    template <typename Visit>
+    void for_each_cell(Visit &&visit) const;
+
+    // An Octray of the same geometry and parameters holding every known cell
+    std::unique_ptr<Octray> to_octray() const;
+
+    // Forgets every cell
+    void clear();
+
+    size_t brick_count() const { return bricks.size(); }
+    size_t cell_count() const;
+    size_t bytes_reserved() const { return sizeof(BrickGrid) + bricks.size() * sizeof(Brick) + table.capacity() * sizeof(Slot); }
+    size_t get_max_depth() const { return max_depth; }
+
+private:
+    struct Brick
+    {
+        uint64_t code;                    // morton code of the cells' keys shifted right by BRICK_BITS
+        uint64_t known[BRICK_CELLS / 64]; // set once a ray has crossed the cell
+        float log_odds[BRICK_CELLS];      // by the morton code of the cell within the brick
+    };
+
+    struct Slot
+    {
+        uint64_t code;
+        uint32_t brick;
+    };
+
+    static constexpr uint32_t EMPTY = ~uint32_t{0};
+    static constexpr size_t MIN_SLOTS = 64;
+
+    // Morton code of the key's low BRICK_BITS bits, so a brick's cells are in depth first order
+    static size_t cell_index(const OctreeKey &key)
+    {
+        static constexpr uint8_t spread[8] = {0, 1, 8, 9, 64, 65, 72, 73};
+        return spread[key.x & 7] | spread[key.y & 7] << 1 | spread[key.z & 7] << 2;
+    }
+    static uint64_t brick_code(const OctreeKey &key) { return key.ancestor(BRICK_BITS).morton_code(); }
+
+    size_t slot_of(const uint64_t code) const { return static_cast<size_t>((code * 0x9E3779B97F4A7C15ull) >> shift); }
+    const Brick *find_brick(const uint64_t code) const;
+    // The brick holding the key's cell, created if it has none
+    Brick &brick_at(const OctreeKey &key);
+    void rehash(const size_t slot_count);
+
+    void update_cell(const OctreeKey &key, const int intersection);
+    void set_cell(const OctreeKey &key, const float log_odds);
+
+    const Vec3f center;
+    const float size;
+    const Vec3f min_corner;
+    const size_t max_depth;
+    Octray::OccupancyParams occupancy;
+
+    // A deque, so growing never copies the bricks already there
+    std::deque<Brick> bricks;
+    // Open addressing from brick code to brick, with linear probing and Fibonacci hashing
+    std::vector<Slot> table;
+    int shift = 64;
+    // Brick of the last update; the cells along a ray mostly share one
+    uint64_t cached_code = ~uint64_t{0};
+    uint32_t cached_brick = EMPTY;
+};
+
+template <typename Visitor>
+void BrickGrid::accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end, Visitor &visitor)
+{
+    OctreeKey end_key;
+    const bool end_inside = Octray::key_at(min_corner, size, ray_end, max_depth, end_key);
+    Octray::for_each_leaf_on_segment(min_corner, size, max_depth, ray_start, ray_end, [&](const OctreeKey &key)
+                                     {
+        if (end_inside && key == end_key)
+            return;
+        update_cell(key, OctrayNode::PASSES_THROUGH);
+        visitor.on_leaf(key, max_depth, OctrayNode::PASSES_THROUGH); });
+
+    // Hit separately, as rounding can end the walk a cell short
+    if (end_inside)
+    {
+        update_cell(end_key, OctrayNode::END_POINT_INSIDE);
+        visitor.on_leaf(end_key, max_depth, OctrayNode::END_POINT_INSIDE);
+    }
+}
+
+template <typename Visit>
+void BrickGrid::for_each_cell(Visit &&visit) const
+{
+    std::vector<uint32_t> order(bricks.size());
+    for (uint32_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b)
+              { return bricks[a].code < bricks[b].code; });
+
+    for (uint32_t i : order)
+    {
+        const Brick &brick = bricks[i];
+        for (size_t cell = 0; cell < BRICK_CELLS; cell++)
+        {
+            if (brick.known[cell / 64] & (uint64_t{1} << (cell % 64)))
+                visit(brick.code << (3 * BRICK_BITS) | cell, brick.log_odds[cell]);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define OCTRAY_CHILD_INTERVALS_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OCTRAY_CHILD_INTERVALS_SSE
+#endif
+
+#include <algorithm>
+#include <limits>
+
+// Slab test of a segment against all 8 children of a node at once. Takes the node's
+// entry (t0), mid-plane (tm) and exit (t1) parameters per axis in the mirrored frame,
+// where child c spans [t0, tm] on axis i when bit i of c is clear and [tm, t1] when
+// it is set. Writes each child's entry parameter and returns the mask of children
+// whose interval overlaps the segment t in [0, 1] (touching counts).
+inline int intersect_children(const float t0[3], const float tm[3], const float t1[3], float entry[8])
+{
+#if defined(OCTRAY_CHILD_INTERVALS_AVX)
+    __m256 enter = _mm256_max_ps(_mm256_max_ps(
+                                     _mm256_setr_ps(t0[0], tm[0], t0[0], tm[0], t0[0], tm[0], t0[0], tm[0]),
+                                     _mm256_setr_ps(t0[1], t0[1], tm[1], tm[1], t0[1], t0[1], tm[1], tm[1])),
+                                 _mm256_setr_ps(t0[2], t0[2], t0[2], t0[2], tm[2], tm[2], tm[2], tm[2]));
+    __m256 exit = _mm256_min_ps(_mm256_min_ps(
+                                    _mm256_setr_ps(tm[0], t1[0], tm[0], t1[0], tm[0], t1[0], tm[0], t1[0]),
+                                    _mm256_setr_ps(tm[1], tm[1], t1[1], t1[1], tm[1], tm[1], t1[1], t1[1])),
+                                _mm256_setr_ps(tm[2], tm[2], tm[2], tm[2], t1[2], t1[2], t1[2], t1[2]));
+
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ),
+                               _mm256_and_ps(_mm256_cmp_ps(exit, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                             _mm256_cmp_ps(enter, _mm256_set1_ps(1.0f), _CMP_LE_OQ)));
+    _mm256_storeu_ps(entry, enter);
+    return _mm256_movemask_ps(hit);
+#elif defined(OCTRAY_CHILD_INTERVALS_SSE)
+    // Lanes hold children 0-3 (lower z) and 4-7 (upper z); x and y alternate the same way in both
+    __m128 enter_xy = _mm_max_ps(_mm_setr_ps(t0[0], tm[0], t0[0], tm[0]), _mm_setr_ps(t0[1], t0[1], tm[1], tm[1]));
+    __m128 exit_xy = _mm_min_ps(_mm_setr_ps(tm[0], t1[0], tm[0], t1[0]), _mm_setr_ps(tm[1], tm[1], t1[1], t1[1]));
+
+    __m128 enter_lo = _mm_max_ps(enter_xy, _mm_set1_ps(t0[2]));
+    __m128 enter_hi = _mm_max_ps(enter_xy, _mm_set1_ps(tm[2]));
+    __m128 exit_lo = _mm_min_ps(exit_xy, _mm_set1_ps(tm[2]));
+    __m128 exit_hi = _mm_min_ps(exit_xy, _mm_set1_ps(t1[2]));
+
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 hit_lo = _mm_and_ps(_mm_cmple_ps(enter_lo, exit_lo), _mm_and_ps(_mm_cmpge_ps(exit_lo, zero), _mm_cmple_ps(enter_lo, one)));
+    __m128 hit_hi = _mm_and_ps(_mm_cmple_ps(enter_hi, exit_hi), _mm_and_ps(_mm_cmpge_ps(exit_hi, zero), _mm_cmple_ps(enter_hi, one)));
+
+    _mm_storeu_ps(entry, enter_lo);
+    _mm_storeu_ps(entry + 4, enter_hi);
+    return _mm_movemask_ps(hit_lo) | (_mm_movemask_ps(hit_hi) << 4);
+#else
+    int mask = 0;
+    for (int c = 0; c < 8; c++)
+    {
+        float enter = -std::numeric_limits<float>::infinity();
+        float exit = std::numeric_limits<float>::infinity();
+        for (int i = 0; i < 3; i++)
+        {
+            bool upper = c & (1 << i);
+            enter = std::max(enter, upper ? tm[i] : t0[i]);
+            exit = std::min(exit, upper ? t1[i] : tm[i]);
+        }
+        entry[c] = enter;
+        if (enter <= exit && exit >= 0.0f && enter <= 1.0f)
+            mask |= 1 << c;
+    }
+    return mask;
+#endif
+}
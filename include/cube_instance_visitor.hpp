@@ -0,0 +1,65 @@
+#pragma once
+
+#include "octray_node.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Index into the palette of cube_vertex_shader.glsl
+enum CubeColor : uint8_t
+{
+    CUBE_GREEN = 0,
+    CUBE_RED = 1,
+    CUBE_WHITE = 2,
+    CUBE_ORANGE = 3,
+    CUBE_HIDDEN = 255 // drawn as nothing, for unused slots of a buffer
+};
+
+// One cube as the vertex shader reads it, which rebuilds the transform: the cube is the
+// cell at depth centered on center, its edge the root size (a uniform) halved depth times
+struct CubeInstance
+{
+    float center[3];
+    uint8_t depth;
+    uint8_t color; // a CubeColor
+    uint8_t padding[2];
+};
+
+static_assert(sizeof(CubeInstance) == 16, "CubeInstance is uploaded per cube and should stay small");
+
+inline CubeInstance make_cube_instance(const Octray &octray, const OctreeKey &key, const size_t depth, const CubeColor color)
+{
+    Vec3f center = octray.node_center(key, depth);
+    return {{center.x, center.y, center.z}, static_cast<uint8_t>(depth), color, {0, 0}};
+}
+
+// Collects a cube per cell a ray visits for rendering: leaves it passes through are
+// filled green, the leaf it ends in red, and the cells it misses are outlined
+class CubeInstanceVisitor : public OctrayVisitor
+{
+public:
+    CubeInstanceVisitor(const Octray &_octray, std::vector<CubeInstance> &_filledInstances, std::vector<CubeInstance> &_outlinedInstances)
+        : octray(_octray), filledInstances(_filledInstances), outlinedInstances(_outlinedInstances) {}
+
+    void on_leaf(const OctreeKey &key, const size_t depth, const int intersection)
+    {
+        if (intersection == OctrayNode::PASSES_THROUGH)
+        {
+            filledInstances.push_back(make_cube_instance(octray, key, depth, CUBE_GREEN));
+        }
+        else if (intersection == OctrayNode::END_POINT_INSIDE)
+        {
+            filledInstances.push_back(make_cube_instance(octray, key, depth, CUBE_RED));
+        }
+    }
+
+    void on_miss(const OctreeKey &key, const size_t depth)
+    {
+        outlinedInstances.push_back(make_cube_instance(octray, key, depth, CUBE_WHITE));
+    }
+
+private:
+    const Octray &octray;
+    std::vector<CubeInstance> &filledInstances;
+    std::vector<CubeInstance> &outlinedInstances;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "octray_node.hpp"
+
+#include <bitset>
+#include <cstdint>
+#include <vector>
+
+// Immutable copy of an Octray, made by Octray::freeze(), for maps that are only queried. The
+// nodes are stored breadth first with no pointers: one bit per node marking inner nodes, then
+// the child masks of the inner nodes in the same order, 8 bits each. Rank indexes over the two
+// bitvectors give the position of a node's children, so the structure costs about 2 bits per
+// node plus a float of log odds each, inner nodes holding the max of their leaves as in Octray.
+// Queries only read flat arrays, safe from any number of threads.
+class FrozenOctray
+{
+public:
+    struct Node
+    {
+        OctreeKey key;
+        size_t depth;
+        float log_odds;
+    };
+
+    // Same lookup as Octray::search: the deepest known node containing point down to the
+    // query depth, or a pruned node above it. False if outside the octree or never observed.
+    bool search(const Vec3f &point, Node &node, const size_t query_depth = Octray::MAX_DEPTH_LIMIT) const;
+    // Same cast as Octray::cast_ray, with the same traversal, so hits are identical
+    bool cast_ray(const Vec3f &origin, const Vec3f &direction, const float max_range, Octray::RayHit &hit,
+                  const size_t query_depth = Octray::MAX_DEPTH_LIMIT) const;
+    bool is_occupied(const Node &node) const { return node.log_odds > occupancy.occupied_threshold; }
+
+    const Octray::OccupancyParams &get_occupancy_params() const { return occupancy; }
+    size_t node_count() const { return log_odds.size(); }
+    // Bytes of the bitvectors and their rank indexes, without the log odds
+    size_t structure_bytes() const { return inner.bytes() + masks.bytes(); }
+    size_t bytes_reserved() const { return sizeof(FrozenOctray) + structure_bytes() + log_odds.capacity() * sizeof(float); }
+
+    size_t get_max_depth() const { return geometry.get_max_depth(); }
+    Vec3f node_center(const OctreeKey &key, const size_t depth) const { return geometry.node_center(key, depth); }
+    float node_size(const size_t depth) const { return geometry.node_size(depth); }
+
+private:
+    friend class Octray;
+
+    // Bitvector with the count of set bits before every 512 bit block
+    struct RankBits
+    {
+        static constexpr size_t BLOCK_WORDS = 8;
+
+        std::vector<uint64_t> words;
+        std::vector<uint64_t> blocks;
+        size_t size = 0;
+
+        // width divides 64, so a value never straddles two words
+        void append(const uint64_t value, const int width)
+        {
+            if (size % 64 == 0)
+                words.push_back(0);
+            words.back() |= value << (size % 64);
+            size += width;
+        }
+        void build_index();
+        uint64_t get(const size_t i, const int width) const { return words[i / 64] >> (i % 64) & ((uint64_t{1} << width) - 1); }
+        // Set bits before bit i
+        size_t rank(const size_t i) const
+        {
+            const size_t word = i / 64;
+            size_t count = blocks[word / BLOCK_WORDS];
+            for (size_t w = word - word % BLOCK_WORDS; w < word; w++)
+                count += std::bitset<64>(words[w]).count();
+            if (i % 64)
+                count += std::bitset<64>(words[word] & ((uint64_t{1} << (i % 64)) - 1)).count();
+            return count;
+        }
+        size_t bytes() const { return (words.capacity() + blocks.capacity()) * sizeof(uint64_t); }
+    };
+
+    FrozenOctray(const Vec3f &_center, const float _size, const size_t _max_depth, const Octray::OccupancyParams &_occupancy);
+
+    bool is_inner(const size_t node) const { return inner.get(node, 1); }
+    // Mask of the inner node's children, and in first the index of its first child
+    uint8_t children_of(const size_t node, size_t &first) const
+    {
+        const size_t mask_bit = 8 * inner.rank(node);
+        first = 1 + masks.rank(mask_bit);
+        return static_cast<uint8_t>(masks.get(mask_bit, 8));
+    }
+    static size_t children_before(const uint8_t mask, const int child) { return std::bitset<8>(mask & ((1u << child) - 1)).count(); }
+
+    bool cast_subtree(const size_t node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const float t0[3], const float t1[3],
+                      const OctreeGeometry::TraversalRay &ray, Octray::RayHit &hit) const;
+
+    OctreeGeometry geometry;
+    Octray::OccupancyParams occupancy;
+
+    RankBits inner; // by node, set for inner nodes
+    RankBits masks; // 8 bits per inner node
+    std::vector<float> log_odds;
+};
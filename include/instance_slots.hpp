@@ -0,0 +1,115 @@
+#pragma once
+
+#include "octray_node.hpp"
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+// CPU side of a persistent instance buffer kept in step with an Octray. Each drawn node owns
+// a slot; update() takes the tree's changes and rewrites only the slots of changed nodes, and
+// flush() hands the written slots out as ranges to patch on the GPU. Freed slots hold a hidden
+// instance until reused, so the buffer grows with the nodes drawn at once, not with churn.
+template <typename Instance>
+class InstanceSlots
+{
+public:
+    // hidden fills free slots, e.g. a zero scale instance that rasterizes to nothing
+    explicit InstanceSlots(const Instance &_hidden) : hidden(_hidden) {}
+
+    // make(node, key, depth, instance) is asked about each changed leaf, a max depth leaf or
+    // a pruned node; it fills instance and returns true to draw the node, false to leave it out
+    template <typename Make>
+    void update(Octray &octray, Make &&make)
+    {
+        OCTRAY_TIME_SCOPE(TIME_INSTANCE_UPDATE);
+        const size_t max_depth = octray.get_max_depth();
+        octray.take_changes([&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                            {
+            const int shift = 3 * static_cast<int>(max_depth - depth);
+            const uint64_t first = key.morton_code() << shift;
+
+            // Split since it was drawn, its children come next
+            if (!node.is_leaf())
+            {
+                auto owner = owners.find({first, depth});
+                if (owner != owners.end())
+                {
+                    release(owner->second);
+                    owners.erase(owner);
+                }
+                return;
+            }
+
+            // The cell's nodes are the owners whose first cell lies in it
+            auto begin = owners.lower_bound({first, 0});
+            auto end = owners.lower_bound({first + (uint64_t{1} << shift), 0});
+            for (auto owner = begin; owner != end; ++owner)
+                release(owner->second);
+            owners.erase(begin, end);
+
+            Instance instance = hidden;
+            if (make(node, key, depth, instance))
+            {
+                const size_t slot = acquire();
+                slots[slot] = instance;
+                dirty.push_back(slot);
+                OCTRAY_COUNT(INSTANCES_WRITTEN, 1);
+                owners.emplace(std::make_pair(first, depth), slot);
+            } });
+    }
+
+    // Calls upload(first_slot, count) for each run of slots written since the last flush.
+    // Runs less than merge_gap slots apart are joined, fewer calls for some redundant bytes.
+    template <typename Upload>
+    void flush(Upload &&upload, const size_t merge_gap = 16)
+    {
+        std::sort(dirty.begin(), dirty.end());
+        dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+        for (size_t i = 0; i < dirty.size();)
+        {
+            size_t last = i;
+            while (last + 1 < dirty.size() && dirty[last + 1] - dirty[last] <= merge_gap)
+                last++;
+            upload(dirty[i], dirty[last] - dirty[i] + 1);
+            i = last + 1;
+        }
+        dirty.clear();
+    }
+
+    // Every slot, hidden ones included, so draw slot_count() instances
+    const std::vector<Instance> &instances() const { return slots; }
+    size_t slot_count() const { return slots.size(); }
+    size_t drawn_count() const { return owners.size(); }
+    size_t dirty_count() const { return dirty.size(); }
+
+private:
+    size_t acquire()
+    {
+        if (free_slots.empty())
+        {
+            slots.push_back(hidden);
+            return slots.size() - 1;
+        }
+        const size_t slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    void release(const size_t slot)
+    {
+        slots[slot] = hidden;
+        free_slots.push_back(slot);
+        dirty.push_back(slot);
+        OCTRAY_COUNT(INSTANCES_WRITTEN, 1);
+    }
+
+    Instance hidden;
+    std::vector<Instance> slots;
+    std::vector<size_t> free_slots;
+    std::vector<size_t> dirty;
+    // Slot of each drawn node, by the morton code of its first max depth cell and its depth,
+    // so the nodes inside any cell are one contiguous range
+    std::map<std::pair<uint64_t, size_t>, size_t> owners;
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "octray_file_format.hpp"
+#include "octray_node.hpp"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+// Read-only view of a file written by Octray::write. The file is memory mapped and searched
+// in place, so opening costs the same for any size and pages are only read as queries touch
+// them. Record offsets are checked against the file as queries reach them, so a corrupt file
+// fails the query instead of reading outside the mapping.
+class MappedOctray
+{
+public:
+    // Throws std::runtime_error if path cannot be mapped or is not an octray file
+    explicit MappedOctray(const std::string &path);
+    ~MappedOctray();
+
+    MappedOctray(const MappedOctray &) = delete;
+    MappedOctray &operator=(const MappedOctray &) = delete;
+
+    struct Node
+    {
+        OctreeKey key;
+        size_t depth;
+        float log_odds;
+    };
+
+    // Same lookup as Octray::search: the deepest known node containing point down to the
+    // query depth, or a pruned node above it. False if outside the octree or never observed.
+    // Throws std::runtime_error if a record it reaches runs past its parent's subtree.
+    bool search(const Vec3f &point, Node &node, const size_t query_depth = Octray::MAX_DEPTH_LIMIT) const;
+    bool is_occupied(const Node &node) const { return node.log_odds > header.occupied_threshold; }
+
+    size_t get_max_depth() const { return header.max_depth; }
+    size_t node_count() const { return header.node_count; }
+    Vec3f node_center(const OctreeKey &key, const size_t depth) const;
+    float node_size(const size_t depth) const { return std::ldexp(header.size, -static_cast<int>(depth)); }
+
+private:
+    void unmap();
+    // Bytes of the records of the subtree at record, which must end by end
+    static size_t subtree_bytes(const unsigned char *record, const unsigned char *end);
+
+    const unsigned char *records = nullptr; // first node record, just past the header
+    const void *mapping = nullptr;
+    size_t mapping_bytes = 0;
+    std::vector<unsigned char> buffer; // file contents where mmap is unavailable
+
+    OctrayFileHeader header;
+    Vec3f min_corner;
+};
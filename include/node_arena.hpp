@@ -0,0 +1,301 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "octray_stats.hpp"
+
+// Per-tree storage for octree nodes. Memory is handed out in blocks of 8 sibling
+// slots, carved from large chunks, so siblings share cache lines and the whole tree
+// is dropped by releasing the chunks. Nodes are never destructed individually.
+//
+// Every block carries a tag, the arena's tag when it was allocated, kept in a table at
+// the start of its chunk. Chunks are aligned to their size so the table is found from
+// the block pointer alone.
+template <typename NodeType>
+class NodeArena
+{
+public:
+    static constexpr size_t BLOCK_ALIGNMENT = 64;
+    static constexpr size_t BLOCKS_PER_CHUNK = 1024;
+
+    NodeArena() = default;
+    NodeArena(const NodeArena &) = delete;
+    NodeArena &operator=(const NodeArena &) = delete;
+
+    ~NodeArena() { release(); }
+
+    // Uninitialized storage for 8 sibling nodes, tagged with the arena's current tag
+    NodeType *allocate_block()
+    {
+        if (!free_list && source)
+            borrow();
+        if (++blocks_in_use > peak_blocks)
+            peak_blocks = blocks_in_use;
+        OCTRAY_COUNT(BLOCKS_ALLOCATED, 1);
+        OCTRAY_GAUGE_ADD(BYTES_IN_USE, BLOCK_BYTES);
+        NodeType *block = take_block();
+        block_tag(block) = tag;
+        return block;
+    }
+
+    // Has this arena take its blocks from _source, BORROW_BLOCKS at a time under a lock, instead
+    // of reserving chunks of its own; for worker threads filling one tree. Every chunk stays
+    // _source's, and adopt() hands back the blocks left over.
+    void borrow_from(NodeArena *_source) { source = _source; }
+
+    static uint64_t &block_tag(const NodeType *block)
+    {
+        uintptr_t address = reinterpret_cast<uintptr_t>(block);
+        uint64_t *tags = reinterpret_cast<uint64_t *>(address & ~(uintptr_t{CHUNK_BYTES} - 1));
+        return tags[(address & (CHUNK_BYTES - 1)) / BLOCK_BYTES];
+    }
+
+    // Tag given to blocks allocated from now on
+    void set_tag(const uint64_t _tag) { tag = _tag; }
+    uint64_t get_tag() const { return tag; }
+
+    // The block's nodes must not be used afterwards
+    void free_block(NodeType *block)
+    {
+        blocks_in_use--;
+        OCTRAY_COUNT(BLOCKS_FREED, 1);
+        OCTRAY_GAUGE_ADD(BYTES_IN_USE, -static_cast<int64_t>(BLOCK_BYTES));
+        push_free(block);
+    }
+
+    // Free block later, once release_deferred is called with a tag of at least free_tag.
+    // For blocks other threads may still be reading.
+    void defer_free(NodeType *block, const uint64_t free_tag)
+    {
+        deferred.push_back({block, free_tag});
+    }
+
+    // Free every deferred block whose free tag is at most up_to_tag
+    void release_deferred(const uint64_t up_to_tag)
+    {
+        auto kept = std::partition(deferred.begin(), deferred.end(), [&](const DeferredBlock &entry)
+                                   { return entry.free_tag > up_to_tag; });
+        for (auto entry = kept; entry != deferred.end(); ++entry)
+            free_block(entry->block);
+        deferred.erase(kept, deferred.end());
+    }
+
+    size_t deferred_count() const { return deferred.size(); }
+
+    // Give every block handed out so far the tag, e.g. ahead of adopting them into an arena
+    // whose tags mean something else
+    void retag(const uint64_t new_tag)
+    {
+        for (size_t i = 0; i < active_chunks; i++)
+            std::fill_n(reinterpret_cast<uint64_t *>(chunks[i]), BLOCKS_PER_CHUNK, new_tag);
+        for (NodeType *chunk : adopted_chunks)
+            std::fill_n(reinterpret_cast<uint64_t *>(chunk), BLOCKS_PER_CHUNK, new_tag);
+    }
+
+    // Take over the blocks of another arena, e.g. one filled by a worker thread, along with
+    // its free blocks and the unused rest of its chunks, all allocated from here on.
+    void adopt(NodeArena &other)
+    {
+        // The rest of the chunk it was carving goes on the free list, so every adopted chunk
+        // is carved in full
+        if (other.active_chunks)
+        {
+            NodeType *chunk = other.chunks[other.active_chunks - 1];
+            for (size_t b = other.used_in_chunk; b < BLOCKS_PER_CHUNK; b++)
+                push_free(chunk + 8 * b);
+        }
+        for (NodeType *block = other.free_list; block;)
+        {
+            NodeType *next = next_free(block);
+            push_free(block);
+            block = next;
+        }
+
+        for (size_t i = 0; i < other.active_chunks; i++)
+            adopted_chunks.push_back(other.chunks[i]);
+        // Spare chunks stay spare
+        chunks.insert(chunks.end(), other.chunks.begin() + other.active_chunks, other.chunks.end());
+        adopted_chunks.insert(adopted_chunks.end(), other.adopted_chunks.begin(), other.adopted_chunks.end());
+        deferred.insert(deferred.end(), other.deferred.begin(), other.deferred.end());
+        // Its blocks were all in use alongside these, at its own peak at the most
+        peak_blocks = std::max(peak_blocks, blocks_in_use + other.peak_blocks);
+        blocks_in_use += other.blocks_in_use;
+        other.blocks_in_use = 0;
+        other.peak_blocks = 0;
+
+        other.chunks.clear();
+        other.adopted_chunks.clear();
+        other.reset();
+    }
+
+    // Forget every block, keeping the chunks to be reused
+    void reset()
+    {
+        chunks.insert(chunks.end(), adopted_chunks.begin(), adopted_chunks.end());
+        adopted_chunks.clear();
+        deferred.clear();
+        free_list = nullptr;
+        active_chunks = 0;
+        used_in_chunk = BLOCKS_PER_CHUNK;
+        OCTRAY_GAUGE_ADD(BYTES_IN_USE, -static_cast<int64_t>(blocks_in_use * BLOCK_BYTES));
+        blocks_in_use = 0;
+    }
+
+    // Forget every block and return the chunks to the system
+    void release()
+    {
+        OCTRAY_GAUGE_ADD(BYTES_RESERVED, -static_cast<int64_t>(bytes_reserved()));
+        for (NodeType *chunk : chunks)
+            ::operator delete(chunk, std::align_val_t{CHUNK_BYTES});
+        for (NodeType *chunk : adopted_chunks)
+            ::operator delete(chunk, std::align_val_t{CHUNK_BYTES});
+        chunks.clear();
+        adopted_chunks.clear();
+        reset();
+    }
+
+    // Return to the system every chunk with no block in use, spare chunks included. Blocks
+    // deferred for freeing count as in use. Walks the whole free list.
+    void trim()
+    {
+        // The rest of the chunk being carved goes on the free list, so every chunk in use is
+        // carved in full and its free blocks are all on the list
+        if (active_chunks)
+        {
+            NodeType *chunk = chunks[active_chunks - 1];
+            for (size_t b = used_in_chunk; b < BLOCKS_PER_CHUNK; b++)
+                push_free(chunk + 8 * b);
+            used_in_chunk = BLOCKS_PER_CHUNK;
+        }
+
+        std::vector<NodeType *> held(chunks.begin(), chunks.begin() + active_chunks);
+        held.insert(held.end(), adopted_chunks.begin(), adopted_chunks.end());
+        std::sort(held.begin(), held.end());
+        auto chunk_index = [&](const NodeType *block)
+        {
+            const NodeType *chunk = reinterpret_cast<const NodeType *>(reinterpret_cast<uintptr_t>(block) & ~(uintptr_t{CHUNK_BYTES} - 1));
+            return std::lower_bound(held.begin(), held.end(), chunk) - held.begin();
+        };
+        std::vector<size_t> free_blocks(held.size(), 0);
+        for (NodeType *block = free_list; block; block = next_free(block))
+            free_blocks[chunk_index(block)]++;
+
+        // Relink the free list without the blocks of empty chunks
+        NodeType *kept = nullptr;
+        for (NodeType *block = free_list; block;)
+        {
+            NodeType *next = next_free(block);
+            if (free_blocks[chunk_index(block)] != BLOCKS_PER_CHUNK - TAG_BLOCKS)
+            {
+                std::memcpy(static_cast<void *>(block), &kept, sizeof(NodeType *));
+                kept = block;
+            }
+            block = next;
+        }
+        free_list = kept;
+
+        auto empty = [&](NodeType *chunk)
+        {
+            const size_t i = std::lower_bound(held.begin(), held.end(), chunk) - held.begin();
+            if (free_blocks[i] != BLOCKS_PER_CHUNK - TAG_BLOCKS)
+                return false;
+            ::operator delete(chunk, std::align_val_t{CHUNK_BYTES});
+            OCTRAY_GAUGE_ADD(BYTES_RESERVED, -static_cast<int64_t>(CHUNK_BYTES));
+            return true;
+        };
+        adopted_chunks.erase(std::remove_if(adopted_chunks.begin(), adopted_chunks.end(), empty), adopted_chunks.end());
+        for (size_t i = active_chunks; i < chunks.size(); i++)
+        {
+            ::operator delete(chunks[i], std::align_val_t{CHUNK_BYTES});
+            OCTRAY_GAUGE_ADD(BYTES_RESERVED, -static_cast<int64_t>(CHUNK_BYTES));
+        }
+        chunks.resize(active_chunks);
+        chunks.erase(std::remove_if(chunks.begin(), chunks.end(), empty), chunks.end());
+        active_chunks = chunks.size();
+    }
+
+    size_t block_count() const { return blocks_in_use; }
+    // Most blocks in use at once, counting an adopted arena's peak on top of the blocks in use
+    // here when it was adopted; never lowered
+    size_t peak_block_count() const { return peak_blocks; }
+    size_t bytes_reserved() const { return (chunks.size() + adopted_chunks.size()) * CHUNK_BYTES; }
+
+private:
+    static constexpr size_t BLOCK_BYTES = 8 * sizeof(NodeType);
+    static constexpr size_t CHUNK_BYTES = BLOCK_BYTES * BLOCKS_PER_CHUNK;
+    // Leading blocks of each chunk given over to its tag table
+    static constexpr size_t TAG_BLOCKS = (BLOCKS_PER_CHUNK * sizeof(uint64_t) + BLOCK_BYTES - 1) / BLOCK_BYTES;
+
+    static_assert(BLOCK_BYTES % alignof(NodeType) == 0 && alignof(NodeType) <= BLOCK_ALIGNMENT,
+                  "node blocks must stay aligned inside a chunk");
+    static_assert((CHUNK_BYTES & (CHUNK_BYTES - 1)) == 0, "chunks are aligned to their size, which must be a power of two");
+
+    // Blocks a borrowing arena takes per lock of its source
+    static constexpr size_t BORROW_BLOCKS = 64;
+
+    struct DeferredBlock
+    {
+        NodeType *block;
+        uint64_t free_tag;
+    };
+
+    // Storage for a block, from the free list or else carved from the current chunk
+    NodeType *take_block()
+    {
+        if (free_list)
+        {
+            NodeType *block = free_list;
+            free_list = next_free(block);
+            return block;
+        }
+        if (used_in_chunk == BLOCKS_PER_CHUNK)
+        {
+            if (active_chunks == chunks.size())
+            {
+                chunks.push_back(static_cast<NodeType *>(::operator new(CHUNK_BYTES, std::align_val_t{CHUNK_BYTES})));
+                OCTRAY_GAUGE_ADD(BYTES_RESERVED, CHUNK_BYTES);
+            }
+            active_chunks++;
+            used_in_chunk = TAG_BLOCKS;
+        }
+        return chunks[active_chunks - 1] + 8 * used_in_chunk++;
+    }
+
+    void borrow()
+    {
+        std::lock_guard<std::mutex> lock(source->lending);
+        for (size_t i = 0; i < BORROW_BLOCKS; i++)
+            push_free(source->take_block());
+    }
+
+    // A free block's first bytes link to the next one
+    void push_free(NodeType *block)
+    {
+        std::memcpy(static_cast<void *>(block), &free_list, sizeof(NodeType *));
+        free_list = block;
+    }
+    static NodeType *next_free(NodeType *block)
+    {
+        NodeType *next;
+        std::memcpy(&next, static_cast<void *>(block), sizeof(NodeType *));
+        return next;
+    }
+
+    std::vector<NodeType *> chunks;
+    std::vector<NodeType *> adopted_chunks;
+    size_t active_chunks = 0;
+    size_t used_in_chunk = BLOCKS_PER_CHUNK;
+    size_t blocks_in_use = 0;
+    size_t peak_blocks = 0;
+    NodeType *free_list = nullptr;
+    std::vector<DeferredBlock> deferred;
+    uint64_t tag = 0;
+    NodeArena *source = nullptr;
+    std::mutex lending; // held by arenas borrowing from this one
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Layout written by Octray::write, loaded by Octray::read and queried in place by MappedOctray.
+//
+// The header is followed by every node in depth first order, children in index order:
+//   leaf:  u8 child_mask (0), f32 log_odds
+//   inner: u8 child_mask, f32 log_odds, u64 bytes of the records of the nodes below it
+// The byte count lets a reader step over a sibling's subtree without parsing it. Records are
+// packed with no padding, in host byte order, which byte_order guards against on load.
+struct OctrayFileHeader
+{
+    static constexpr char MAGIC[8] = {'O', 'C', 'T', 'R', 'A', 'Y', '\0', '\0'};
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t ENDIAN_TAG = 0x01020304;
+    static constexpr size_t LEAF_RECORD_BYTES = 5;
+    static constexpr size_t INNER_RECORD_BYTES = 13;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t max_depth;
+    float center[3];
+    float size;
+    float hit, miss, clamp_min, clamp_max, occupied_threshold;
+    uint64_t node_count;
+    uint64_t stream_bytes; // every record after the header
+
+    // nullptr if the header is usable for a file of file_bytes, otherwise what is wrong
+    const char *validate(const size_t file_bytes, const size_t max_depth_limit) const
+    {
+        if (std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+            return "not an octray file";
+        if (version != VERSION)
+            return "unsupported octray file version";
+        if (byte_order != ENDIAN_TAG)
+            return "octray file was written with a different byte order";
+        if (max_depth > max_depth_limit)
+            return "octray file max_depth exceeds MAX_DEPTH_LIMIT";
+        if (!(clamp_min < 0.0f && clamp_max > 0.0f))
+            return "octray file occupancy clamp range must contain 0";
+        if (!(hit > 0.0f && miss < 0.0f))
+            return "octray file occupancy hit must be positive and miss negative";
+        if (stream_bytes < LEAF_RECORD_BYTES || file_bytes < sizeof(OctrayFileHeader) || file_bytes - sizeof(OctrayFileHeader) != stream_bytes)
+            return "octray file is truncated";
+        return nullptr;
+    }
+};
+
+static_assert(sizeof(OctrayFileHeader) == 72, "OctrayFileHeader is written as is and must not change layout");
@@ -1,9 +1,24 @@
 #pragma once
 
 #include "base_octree_node.hpp"
+#include "child_intervals.hpp"
+#include "octree_geometry.hpp"
+#include "octree_key.hpp"
+#include "octree_key_set.hpp"
+#include "octray_stats.hpp"
+#include "vectors.hpp"
+#include "view_frustum.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <iosfwd>
+#include <limits>
+#include <memory>
+#include <string>
+#include <type_traits>
 #include <vector>
-#include <glm/glm.hpp>
 
 class OctrayNode : public BaseOctreeNode<OctrayNode>
 {
@@ -18,30 +33,816 @@ public:
         END_POINT_INSIDE = 2
     };
 
-    OctrayNode(const Vec3f &_center, const float _size)
-        : BaseOctreeNode(_center, _size) {}
+    float get_log_odds() const { return log_odds; }
+    float get_occupancy() const { return 1.0f - 1.0f / (1.0f + std::exp(log_odds)); }
 
-    OctrayNode(const OctrayNode *_parent, const Vec3f &_center)
-        : BaseOctreeNode(_parent, _center) {}
+private:
+    // Set when the node is created or anything in its subtree changes, cleared by take_changes
+    bool changed = true;
+    // Update epoch, modulo 2^16, that last reached this inner node; for the memory budget
+    uint16_t touched = 0;
+    // Clamped log-odds occupancy. Leaves at max depth hold their own value and inner nodes
+    // the max of their children. A leaf above max depth is a pruned region, one value for all
+    // its cells: of 8 children with the same saturated value, from a merge, or the aggregate of
+    // a subtree the memory budget collapsed. Only nodes with no observations at all hold exactly 0.
+    float log_odds = 0.0f;
+};
 
-    // Return code is IntersectionType
-    int intersects(const Vec3f &ray_start, const Vec3f &ray_end) const;
+static_assert(sizeof(OctrayNode) <= 16, "OctrayNode should stay compact");
+
+// Observes a ray traversal. Octray's traversal is templated on the visitor, so any
+// callback left as the no-op below compiles away entirely.
+struct OctrayVisitor
+{
+    // A max depth leaf the ray passed through or ended in (an IntersectionType)
+    void on_leaf(const OctreeKey &, const size_t, const int) {}
+    // A cell the ray missed: an untouched child of a visited node, or the root
+    void on_miss(const OctreeKey &, const size_t) {}
 };
 
-struct CubeInstance
+struct RaySegment
 {
-    glm::mat4 model;
-    glm::vec3 color;
+    Vec3f start;
+    Vec3f end;
 };
 
-class Octray : public OctrayNode
+class ThreadPool;
+class FrozenOctray;
+
+class Octray : public OctrayNode, private OctreeGeometry
 {
 public:
-    Octray(const Vec3f &_center, const float _size, const size_t _max_depth)
-        : OctrayNode(_center, _size), max_depth(_max_depth) {}
+    // Depth at which accumulate_rays hands out subtrees to worker threads
+    static constexpr size_t PARTITION_DEPTH = 3;
+
+    // Rays traversed together by the batch entry points
+    static constexpr size_t PACKET_WIDTH = 8;
+
+    // Keys are 32 bits per axis and centers are computed in float, which is exact to this depth
+    static constexpr size_t MAX_DEPTH_LIMIT = 21;
+
+    Octray(const Vec3f &_center, const float _size, const size_t _max_depth);
+
+    // Log-odds update model, defaults are the usual 0.7 hit / 0.4 miss probabilities
+    // clamped to [0.12, 0.97]
+    struct OccupancyParams
+    {
+        float hit = 0.85f;
+        float miss = -0.4f;
+        float clamp_min = -2.0f;
+        float clamp_max = 3.5f;
+        float occupied_threshold = 0.0f;
+    };
+
+    // Applies to later updates only. Throws std::invalid_argument unless clamp_min < 0 < clamp_max,
+    // hit > 0 and miss < 0.
+    void set_occupancy_params(const OccupancyParams &params);
+    const OccupancyParams &get_occupancy_params() const { return occupancy; }
+
+    struct BatchStats
+    {
+        size_t rays = 0;
+        size_t rays_missed = 0;      // never entered the octree bounds
+        size_t leaves_visited = 0;   // max depth leaves passed through or ended in
+        size_t blocks_allocated = 0; // new sibling blocks, less those freed by pruning
+        size_t threads = 0;
+        size_t tasks = 0;
+        size_t steals = 0;
+        double seconds = 0.0;
+    };
+
+    void accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end);
+
+    template <typename Visitor>
+    void accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end, Visitor &visitor);
+
+    // Inserts up to N rays (4, 8 or 16 are typical) in one walk down the tree. Meant for
+    // coherent rays, such as those of one scan sharing a sensor origin: nodes they have in
+    // common are fetched and split once per packet. Each leaf sees its rays in array order,
+    // so the tree ends up as if they were inserted one by one, but the visitor's callbacks
+    // arrive grouped by node rather than ray by ray.
+    template <size_t N, typename Visitor>
+    void accumulate_ray_packet(const RaySegment *rays, const size_t count, Visitor &visitor);
+
+    // Inserts a batch of rays in packets of PACKET_WIDTH
+    void accumulate_rays(const RaySegment *rays, const size_t count);
+
+    // Caps the memory of the tree's nodes, 0 for no cap. Checked at the end of every update call:
+    // past the budget, the subtrees updated least recently are collapsed, each into one node
+    // holding its aggregate (the max of its leaves), until the nodes fit in 3/4 of the budget.
+    // Rays reaching a collapsed region split it again from that value. Subtrees the latest call
+    // updated are never collapsed, so one call's working set can still exceed the budget; blocks
+    // a snapshot can reach are only freed once it is released. Arena chunks left empty are then
+    // returned to the system, so memory reserved exceeds the budget only by partly used chunks.
+    void set_memory_budget(const size_t bytes) { memory_budget = bytes; }
+    size_t get_memory_budget() const { return memory_budget; }
+    // Bytes of the node blocks in use, which the budget is compared with
+    size_t bytes_in_use() const { return arena.block_count() * 8 * sizeof(OctrayNode); }
+    // Most bytes_in_use() at once since the tree was built. Batches on a pool count each worker
+    // at its own peak, and merges each merged tree at its peak.
+    size_t peak_bytes_in_use() const { return arena.peak_block_count() * 8 * sizeof(OctrayNode); }
+
+    // Inserts a batch of rays using every worker of the pool
+    BatchStats accumulate_rays(const RaySegment *rays, const size_t count, ThreadPool &pool);
+
+    // Inserts a point cloud seen from origin. Every leaf is updated once for the whole scan:
+    // as a hit if any point ends in it, otherwise as a miss if any ray crosses it. Cells near
+    // the sensor then cost one update per scan rather than one per ray crossing them.
+    void insert_scan(const Vec3f &origin, const Vec3f *points, const size_t count);
+
+    // Sets max depth leaves to the given log odds, clamped, in place of what they held; a bulk load
+    // from another representation such as BrickGrid. codes are morton codes of max depth keys in
+    // ascending order, each set to the same index of log_odds. Uniform saturated siblings are pruned.
+    void assign_leaves(const uint64_t *codes, const float *log_odds, const size_t count);
+
+    struct RayHit
+    {
+        OctreeKey key;
+        size_t depth;   // the query depth, or less for a pruned node
+        float distance; // from the origin to where the ray enters the node, 0 if it starts inside
+    };
+
+    // Remove every node below the root, keeping the arena memory for reuse. Nodes a snapshot
+    // may still read are only freed once it is released.
+    void clear();
+
+    // Calls visit(node, key, depth) for every node changed since the last call, parents before
+    // their children, and forgets the changes; the first call visits the whole tree. A visited
+    // leaf changed as a whole cell, so anything derived earlier from nodes inside it is stale.
+    // A visited inner node may have been a leaf before, a pruned node since split. Only paths
+    // to changes are walked, so the cost follows the amount changed rather than the tree size.
+    template <typename Visit>
+    void take_changes(Visit &&visit)
+    {
+        changes_taken = true;
+        take_changes(this, OctreeKey{}, 0, visit);
+    }
+
+    // Adds other's observations to this tree: log odds of cells both know are summed and clamped,
+    // as independent evidence from the same prior, and subtrees only other knows are copied in.
+    // For disjoint batches of rays this equals inserting both into one tree, unless a cell
+    // saturates part way. Uniform saturated siblings are pruned. Throws std::invalid_argument
+    // unless both trees have the same bounds and max depth.
+    void merge(const Octray &other);
+    // As above, but other's nodes are taken over rather than copied: subtrees only other knows
+    // are linked in as they are, and other is left empty. No snapshot of other may be alive.
+    void merge(Octray &&other);
+
+    // Merges every tree into trees[0] and drops the rest, in rounds of pairwise merges run in
+    // parallel, so ceil(log2 n) merges deep. With one tree built per thread from its own batch
+    // of rays, this is insertion that scales without any shared writes. Throws
+    // std::invalid_argument, leaving every tree as it was, if a tree is null or differs from
+    // trees[0] in bounds or max depth.
+    static void merge_all(std::vector<std::unique_ptr<Octray>> &trees, ThreadPool &pool);
+
+    // Most concurrent snapshots; snapshot() throws beyond this
+    static constexpr size_t MAX_SNAPSHOTS = 64;
+
+    // Immutable view of the tree as of one publish(), safe to query from any thread while the
+    // writer carries on. It pins its version until destroyed, so blocks it can reach are not
+    // freed; hold it for a batch of queries, not indefinitely. Must not outlive the Octray.
+    class Snapshot
+    {
+    public:
+        Snapshot(Snapshot &&other) noexcept;
+        Snapshot(const Snapshot &) = delete;
+        Snapshot &operator=(const Snapshot &) = delete;
+        // Releases this snapshot's version before taking over other's
+        Snapshot &operator=(Snapshot &&other) noexcept;
+        ~Snapshot();
+
+        // Number of publish() calls this version includes, 0 for the empty one before the first
+        uint64_t version() const { return pinned_version; }
+
+        const OctrayNode *search(const Vec3f &point, const size_t query_depth = MAX_DEPTH_LIMIT) const { return octray->search(root, point, query_depth); }
+        void query_points(const Vec3f *points, const size_t count, const OctrayNode **results, const size_t query_depth = MAX_DEPTH_LIMIT) const
+        {
+            octray->query_points(root, points, count, results, query_depth);
+        }
+        bool cast_ray(const Vec3f &origin, const Vec3f &direction, const float max_range, RayHit &hit, const size_t query_depth = MAX_DEPTH_LIMIT) const
+        {
+            return octray->cast_ray(root, occupancy, origin, direction, max_range, hit, query_depth);
+        }
+        template <typename Visit>
+        void query_box(const Vec3f &box_min, const Vec3f &box_max, Visit &&visit, const size_t query_depth = MAX_DEPTH_LIMIT) const
+        {
+            octray->query_box(root, box_min, box_max, visit, query_depth);
+        }
+        template <typename Visit>
+        void query_view(const ViewFrustum &frustum, const float min_pixels, Visit &&visit, const size_t query_depth = MAX_DEPTH_LIMIT) const
+        {
+            octray->query_view(root, frustum, min_pixels, visit, query_depth);
+        }
+        bool is_occupied(const OctrayNode &node) const { return node.log_odds > occupancy.occupied_threshold; }
+        const OccupancyParams &get_occupancy_params() const { return occupancy; }
+
+    private:
+        friend class Octray;
+        Snapshot(const Octray *_octray, const OctrayNode *_root, const OccupancyParams &_occupancy, std::atomic<uint64_t> *_slot, const uint64_t _version)
+            : octray(_octray), root(_root), occupancy(_occupancy), slot(_slot), pinned_version(_version) {}
 
-    void accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end, std::vector<CubeInstance> &filledInstances, std::vector<CubeInstance> &outlinedInstances);
+        const Octray *octray;
+        const OctrayNode *root; // nullptr before the first publish
+        // As of the version, so the writer may change the tree's meanwhile
+        OccupancyParams occupancy;
+        std::atomic<uint64_t> *slot;
+        uint64_t pinned_version;
+    };
+
+    // Makes the working tree's current state the version new snapshots see. Every update
+    // and query on the Octray itself is the writer's, on one thread; from then on the writer
+    // copies a sibling block before changing it if a published version can reach it. Blocks
+    // replaced this way are freed here, once no snapshot still pins a version reaching them.
+    void publish();
+
+    // The latest published version. Lock free, callable from any thread at any time.
+    // Throws std::runtime_error if MAX_SNAPSHOTS snapshots are already held.
+    Snapshot snapshot() const;
+
+    // The queries take a query_depth, clamped to max_depth, below which they do not descend. An
+    // inner node there answers for its subtree with the largest log odds of its leaves, so it is
+    // occupied if any of them is. A coarse query costs O(query_depth) rather than O(max_depth).
+
+    // Deepest known node containing point: a leaf at the query depth, an inner node there, or a
+    // pruned node above it. nullptr if the point is outside the octree or in space no ray has crossed.
+    const OctrayNode *search(const Vec3f &point, const size_t query_depth = MAX_DEPTH_LIMIT) const;
+    // search() for a batch of points, written to results[i] for points[i]. The points are visited
+    // in morton order, so consecutive lookups share most of their path from the root and each
+    // one only descends from where it leaves the previous one's path.
+    void query_points(const Vec3f *points, const size_t count, const OctrayNode **results, const size_t query_depth = MAX_DEPTH_LIMIT) const;
+
+    // Calls visit(node, key, depth) for every known node down to the query depth overlapping the
+    // axis aligned box, the deepest on each path as search() would return it: at the query depth,
+    // or a pruned node above it. Boxes touching the octree's faces count as overlapping.
+    template <typename Visit>
+    void query_box(const Vec3f &box_min, const Vec3f &box_max, Visit &&visit, const size_t query_depth = MAX_DEPTH_LIMIT) const
+    {
+        query_box(this, box_min, box_max, visit, query_depth);
+    }
+
+    // Calls visit(node, key, depth) for the known nodes in view, for generating what to draw.
+    // Subtrees outside the frustum are skipped, and a node smaller on screen than min_pixels
+    // stands in for its whole subtree; otherwise the walk goes on down to the query depth or a
+    // leaf. How many nodes that visits follows the view and min_pixels, not the depth of the tree.
+    template <typename Visit>
+    void query_view(const ViewFrustum &frustum, const float min_pixels, Visit &&visit, const size_t query_depth = MAX_DEPTH_LIMIT) const
+    {
+        query_view(this, frustum, min_pixels, visit, query_depth);
+    }
+
+    bool is_occupied(const OctrayNode &node) const { return node.log_odds > occupancy.occupied_threshold; }
+
+    // First occupied node along the ray from origin within max_range, visiting children front to
+    // back and stepping over subtrees with no occupied leaf in one go. Const and allocation free,
+    // so any number of threads may cast at once while no thread modifies the tree.
+    bool cast_ray(const Vec3f &origin, const Vec3f &direction, const float max_range, RayHit &hit, const size_t query_depth = MAX_DEPTH_LIMIT) const;
+
+    // Key of the cell at depth containing point; false if it is outside the octree
+    using OctreeGeometry::key_at;
+
+    // Calls collect(key) for each cell at depth on the segment, a 3D DDA (Amanatides and Woo) on
+    // the cell grid. Much cheaper than descending per ray when only the keys are wanted. Its path
+    // is 6-connected, so unlike the descent it skips cells the segment only grazes at an edge or corner.
+    template <typename Collect>
+    void for_each_leaf_on_segment(const Vec3f &start, const Vec3f &end, Collect &&collect) const
+    {
+        for_each_leaf_on_segment(min_corner, size, max_depth, start, end, collect);
+    }
+    template <typename Collect>
+    static void for_each_leaf_on_segment(const Vec3f &min_corner, const float size, const size_t depth, const Vec3f &start, const Vec3f &end, Collect &&collect);
+
+    // Keys of the cells at depth the segment crosses, front to back, as the insertion descent
+    // reaches them: unlike for_each_leaf_on_segment, cells it only grazes are included
+    void cells_on_segment(const Vec3f &start, const Vec3f &end, const size_t depth, std::vector<OctreeKey> &keys) const;
+
+    // Immutable copy in the succinct layout of frozen_octray.hpp, for a map only queried from now on
+    std::unique_ptr<FrozenOctray> freeze() const;
+
+    // Writes the tree and its occupancy parameters in the format of octray_file_format.hpp,
+    // streaming node by node. Throws std::runtime_error if the stream fails.
+    void write(std::ostream &out) const;
+    void write(const std::string &path) const;
+
+    // Loads a file written by write() into heap nodes, for further updates. To only query
+    // it, MappedOctray opens it in place. Throws std::runtime_error on a malformed file.
+    static std::unique_ptr<Octray> read(std::istream &in);
+    static std::unique_ptr<Octray> read(const std::string &path);
+
+    // Memory held by the tree, including arena chunks not yet handed out
+    size_t bytes_reserved() const { return sizeof(Octray) + arena.bytes_reserved(); }
+
+    using OctreeGeometry::get_max_depth;
+    using OctreeGeometry::node_center;
+    using OctreeGeometry::node_size;
+
+    // Return code is IntersectionType
+    int intersects(const OctreeKey &key, const size_t depth, const Vec3f &ray_start, const Vec3f &ray_end) const;
 
 private:
-    size_t max_depth;
-};
\ No newline at end of file
+    // The N TraversalRays of a packet, one per lane
+    template <size_t N>
+    struct RayPacket
+    {
+        TraversalRay rays[N];
+
+        void set_lane(const size_t lane, const TraversalRay &ray) { rays[lane] = ray; }
+    };
+
+    template <size_t N>
+    struct PacketInterval
+    {
+        float t0[3][N];
+        float t1[3][N];
+
+        void set_lane(const size_t lane, const float lane_t0[3], const float lane_t1[3])
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                t0[i][lane] = lane_t0[i];
+                t1[i][lane] = lane_t1[i];
+            }
+        }
+    };
+
+    // Child i of a node the writer may modify, itself safe to modify. A children block a published
+    // version can reach is copied first, and a pruned node's 8 children are restored.
+    OctrayNode *create_child(OctrayNode *node, const int i, NodeArena<OctrayNode> &node_arena) const;
+    // Unlinked blocks are freed at once if only the writer could reach them, else retired
+    void release_block(OctrayNode *block, NodeArena<OctrayNode> &node_arena) const;
+    void release_subtree(OctrayNode *node);
+
+    // The queries, from the working root or a snapshot's
+    const OctrayNode *search(const OctrayNode *root, const Vec3f &point, const size_t query_depth) const;
+    void query_points(const OctrayNode *root, const Vec3f *points, const size_t count, const OctrayNode **results, const size_t query_depth) const;
+    bool cast_ray(const OctrayNode *root, const OccupancyParams &params, const Vec3f &origin, const Vec3f &direction, const float max_range, RayHit &hit,
+                  const size_t query_depth) const;
+    template <typename Visit>
+    void query_box(const OctrayNode *root, const Vec3f &box_min, const Vec3f &box_max, Visit &visit, const size_t query_depth) const;
+    // Nodes overlapping the cells lo to hi, inclusive, in coordinates at stop_depth
+    template <typename Visit>
+    void query_box_subtree(const OctrayNode *node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const uint32_t lo[3], const uint32_t hi[3],
+                           Visit &visit) const;
+    static bool is_pruned(const OctrayNode *node) { return node->is_leaf() && node->log_odds != 0.0f; }
+
+    void update_leaf(OctrayNode *leaf, const int intersection) const;
+    // Refreshes an inner node from its children after an update below it, collapsing
+    // them back into it when they are uniform and saturated
+    void update_inner(OctrayNode *node, NodeArena<OctrayNode> &node_arena) const;
+    void update_inner_nodes(OctrayNode *node, const size_t depth, const size_t stop_depth);
+
+    template <typename Visit>
+    void query_view(const OctrayNode *root, const ViewFrustum &frustum, const float min_pixels, Visit &visit, const size_t query_depth) const;
+    // planes are those of the frustum the node's parent straddles
+    template <typename Visit>
+    void query_view_subtree(const OctrayNode *node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const int planes,
+                            const ViewFrustum &frustum, const float min_pixels, Visit &visit) const;
+
+    template <typename Visit>
+    void take_changes(OctrayNode *node, const OctreeKey &key, const size_t depth, Visit &visit);
+
+    // Updates are morton codes of max depth leaves shifted left by one, the low bit set for
+    // a hit, sorted so each node's updates are contiguous
+    void apply_updates(OctrayNode *node, const size_t depth, const uint64_t *begin, const uint64_t *end);
+    void assign_leaves(OctrayNode *node, const size_t depth, const uint64_t *begin, const uint64_t *end, const float *log_odds);
+
+    // Ends every update call: applies the memory budget and starts a new epoch
+    void finish_update();
+    uint16_t age(const OctrayNode *node) const { return static_cast<uint16_t>(epoch - node->touched); }
+    void count_block_ages(const OctrayNode *node, std::vector<size_t> &counts) const;
+    // The topmost nodes at least threshold epochs old
+    void find_stale(const OctrayNode *node, const OctreeKey &key, const size_t depth, const uint16_t threshold,
+                    std::vector<std::pair<OctreeKey, size_t>> &stale) const;
+    // Ages are held at AGE_LIMIT once reached, so they never wrap around the 16 bit epochs
+    void saturate_ages(OctrayNode *node);
+
+    template <size_t N, typename Visitor>
+    void insert_ray_packet(const RaySegment *rays, const size_t count, Visitor &visitor);
+
+    void check_same_bounds(const Octray &other) const;
+    // Merges other into node. With owned set, other's blocks belong to this tree and its nodes
+    // are linked in rather than copied, and flagged changed throughout if mark_linked is set.
+    void merge_subtree(OctrayNode *node, const OctrayNode *other, const bool owned, const bool mark_linked);
+    // Adds log_odds to every cell under node, as merging a pruned node does
+    void merge_uniform(OctrayNode *node, const float log_odds);
+    void copy_subtree(OctrayNode *node, const OctrayNode *other);
+    static void mark_changed(OctrayNode *node);
+
+    bool cast_subtree(const OctrayNode *node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const float t0[3], const float t1[3],
+                      const TraversalRay &ray, const OccupancyParams &params, RayHit &hit) const;
+
+    template <typename Collect>
+    void collect_subtrees(const OctreeKey &key, const size_t depth, const size_t stop_depth, const float t0[3], const float t1[3], const TraversalRay &ray, Collect &&collect) const;
+
+    template <typename Visitor>
+    void process_subtree(OctrayNode *node, const OctreeKey &key, const size_t depth, const float t0[3], const float t1[3], const TraversalRay &ray,
+                         NodeArena<OctrayNode> &node_arena, Visitor &visitor);
+
+    // Lanes set in active are the rays overlapping this node
+    template <size_t N, typename Visitor>
+    void process_packet(OctrayNode *node, const OctreeKey &key, const size_t depth, const PacketInterval<N> &interval, const RayPacket<N> &packet,
+                        const uint32_t active, NodeArena<OctrayNode> &node_arena, Visitor &visitor);
+
+    OccupancyParams occupancy;
+    NodeArena<OctrayNode> arena;
+
+    // Version the writer is building, also the arena tag of every block allocated for it.
+    // Blocks with an older tag are shared with published versions and never modified.
+    uint64_t write_version = 1;
+
+    // A publish bumps the sequence to odd, swaps root and version, and bumps it back to even,
+    // so a reader can tell whether the pair it loaded belongs together
+    std::atomic<uint64_t> publish_sequence{0};
+    std::atomic<const OctrayNode *> published_root{nullptr};
+    std::atomic<uint64_t> published_version{0};
+    // Occupancy parameters snapshots copy, swapped in with the root by the first publish after
+    // set_occupancy_params. Each set is kept, with the version that replaced it, until no
+    // snapshot can still be copying it; the last is the published one.
+    std::atomic<const OccupancyParams *> published_occupancy{nullptr};
+    std::vector<std::pair<std::unique_ptr<const OccupancyParams>, uint64_t>> occupancy_versions;
+    bool occupancy_changed = false;
+
+    // Version pinned by each live snapshot
+    static constexpr uint64_t FREE_SLOT = ~uint64_t{0};
+    struct alignas(64) ReaderSlot
+    {
+        std::atomic<uint64_t> version{FREE_SLOT};
+    };
+    std::unique_ptr<ReaderSlot[]> reader_slots;
+
+    size_t memory_budget = 0;
+    // Scratch space of finish_update, blocks counted by the age of their parent
+    std::vector<size_t> blocks_by_age;
+    static constexpr uint16_t AGE_LIMIT = 1 << 15;
+    uint16_t epoch = 0;
+
+    // Until take_changes is first called every node is still flagged changed
+    bool changes_taken = false;
+
+    // Scratch space of insert_scan, kept so later scans do not reallocate
+    OctreeKeySet free_keys;
+    OctreeKeySet occupied_keys;
+    std::vector<uint64_t> scan_updates;
+};
+
+inline OctrayNode *Octray::create_child(OctrayNode *node, const int i, NodeArena<OctrayNode> &node_arena) const
+{
+    if (node->children && NodeArena<OctrayNode>::block_tag(node->children) != write_version)
+    {
+        OctrayNode *copy = node_arena.allocate_block();
+        std::memcpy(static_cast<void *>(copy), node->children, 8 * sizeof(OctrayNode));
+        node_arena.defer_free(node->children, write_version);
+        node->children = copy;
+        OCTRAY_COUNT(BLOCKS_COPIED, 1);
+    }
+    if (is_pruned(node))
+    {
+        OCTRAY_COUNT(PRUNED_EXPANDED, 1);
+        for (int c = 0; c < 8; ++c)
+            node->get_or_create_child(c, node_arena)->log_odds = node->log_odds;
+    }
+    return node->get_or_create_child(i, node_arena);
+}
+
+template <typename Visitor>
+void Octray::accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end, Visitor &visitor)
+{
+    TraversalRay ray;
+    float t0[3], t1[3];
+    if (setup_ray(ray_start, ray_end, ray, t0, t1))
+        process_subtree(this, OctreeKey{}, 0, t0, t1, ray, arena, visitor);
+    else
+        visitor.on_miss(OctreeKey{}, 0);
+    finish_update();
+}
+
+template <typename Visit>
+void Octray::query_view(const OctrayNode *root, const ViewFrustum &frustum, const float min_pixels, Visit &visit, const size_t query_depth) const
+{
+    // A never observed root is the only leaf above max depth that is not pruned
+    if (!root || (root->is_leaf() && max_depth > 0 && !is_pruned(root)))
+        return;
+    query_view_subtree(root, OctreeKey{}, 0, std::min(query_depth, max_depth), ViewFrustum::ALL_PLANES, frustum, min_pixels, visit);
+}
+
+template <typename Visit>
+void Octray::query_view_subtree(const OctrayNode *node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const int planes,
+                                const ViewFrustum &frustum, const float min_pixels, Visit &visit) const
+{
+    OCTRAY_MAX(MAX_TRAVERSAL_DEPTH, depth);
+    const Vec3f center = node_center(key, depth);
+    const float node_edge = node_size(depth);
+
+    // Once inside every plane, the subtree needs no more tests
+    const int straddled = planes ? frustum.cull(center, 0.5f * node_edge, planes) : 0;
+    if (straddled < 0)
+        return;
+
+    if (depth == stop_depth || node->is_leaf() || frustum.projected_size(center, node_edge) < min_pixels)
+    {
+        visit(*node, key, depth);
+        return;
+    }
+    for (int c = 0; c < 8; ++c)
+    {
+        if (node->has_child(c))
+            query_view_subtree(node->child(c), key.child(c), depth + 1, stop_depth, straddled, frustum, min_pixels, visit);
+    }
+}
+
+template <typename Visit>
+void Octray::take_changes(OctrayNode *node, const OctreeKey &key, const size_t depth, Visit &visit)
+{
+    // Only the writer reads the flag, so clearing it in blocks shared with snapshots is safe
+    node->changed = false;
+    visit(static_cast<const OctrayNode &>(*node), key, depth);
+    for (int c = 0; c < 8; ++c)
+    {
+        if (node->has_child(c) && node->child(c)->changed)
+            take_changes(node->child(c), key.child(c), depth + 1, visit);
+    }
+}
+
+template <typename Visit>
+void Octray::query_box(const OctrayNode *root, const Vec3f &box_min, const Vec3f &box_max, Visit &visit, const size_t query_depth) const
+{
+    // A never observed root is the only leaf above max depth that is not pruned
+    if (!root || (root->is_leaf() && max_depth > 0 && !is_pruned(root)))
+        return;
+
+    const size_t stop_depth = std::min(query_depth, max_depth);
+    const float cells = static_cast<float>(uint64_t{1} << stop_depth);
+    const float scale = cells / size;
+    const uint32_t last = static_cast<uint32_t>((uint64_t{1} << stop_depth) - 1);
+    const float box_lo[3] = {(box_min.x - min_corner.x) * scale, (box_min.y - min_corner.y) * scale, (box_min.z - min_corner.z) * scale};
+    const float box_hi[3] = {(box_max.x - min_corner.x) * scale, (box_max.y - min_corner.y) * scale, (box_max.z - min_corner.z) * scale};
+
+    uint32_t lo[3], hi[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!(box_lo[i] <= box_hi[i]) || box_hi[i] < 0.0f || box_lo[i] > cells)
+            return;
+        lo[i] = std::min(static_cast<uint32_t>(std::max(box_lo[i], 0.0f)), last);
+        hi[i] = std::min(static_cast<uint32_t>(std::min(box_hi[i], cells)), last);
+    }
+    query_box_subtree(root, OctreeKey{}, 0, stop_depth, lo, hi, visit);
+}
+
+template <typename Visit>
+void Octray::query_box_subtree(const OctrayNode *node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const uint32_t lo[3], const uint32_t hi[3],
+                               Visit &visit) const
+{
+    OCTRAY_MAX(MAX_TRAVERSAL_DEPTH, depth);
+    if (depth == stop_depth || node->is_leaf())
+    {
+        visit(*node, key, depth);
+        return;
+    }
+
+    // Cells of the children at stop_depth start at child_key << shift
+    const int shift = static_cast<int>(stop_depth - depth - 1);
+    for (int c = 0; c < 8; ++c)
+    {
+        if (!node->has_child(c))
+            continue;
+        const OctreeKey child_key = key.child(c);
+        const uint32_t first[3] = {child_key.x << shift, child_key.y << shift, child_key.z << shift};
+        const uint32_t span = (uint32_t{1} << shift) - 1;
+        bool overlaps = true;
+        for (int i = 0; i < 3; ++i)
+            overlaps &= first[i] <= hi[i] && first[i] + span >= lo[i];
+        if (overlaps)
+            query_box_subtree(node->child(c), child_key, depth + 1, stop_depth, lo, hi, visit);
+    }
+}
+
+template <typename Visitor>
+void Octray::process_subtree(OctrayNode *node, const OctreeKey &key, const size_t depth, const float t0[3], const float t1[3], const TraversalRay &ray,
+                             NodeArena<OctrayNode> &node_arena, Visitor &visitor)
+{
+    // Invariant: the segment t in [0, 1] overlaps the node interval [max(t0), min(t1)]
+    OCTRAY_COUNT(NODES_VISITED, 1);
+    OCTRAY_MAX(MAX_TRAVERSAL_DEPTH, depth);
+    if (depth >= max_depth)
+    {
+        float t_exit = std::min(std::min(t1[0], t1[1]), t1[2]);
+        int intersection = t_exit >= 1.0f ? END_POINT_INSIDE : PASSES_THROUGH;
+        update_leaf(node, intersection);
+        visitor.on_leaf(key, depth, intersection);
+        return;
+    }
+
+    int hit_mask = for_each_child_on_ray(key, depth, t0, t1, ray, [&](int child, const float c0[3], const float c1[3])
+                                         { process_subtree(create_child(node, child, node_arena), key.child(child), depth + 1, c0, c1, ray,
+                                                           node_arena, visitor); });
+    update_inner(node, node_arena);
+
+    // Untouched children are never allocated, only reported
+    for (int i = 0; i < 8; ++i)
+    {
+        if (!(hit_mask & (1 << i)))
+            visitor.on_miss(key.child(i), depth + 1);
+    }
+}
+
+template <size_t N, typename Visitor>
+void Octray::accumulate_ray_packet(const RaySegment *rays, const size_t count, Visitor &visitor)
+{
+    insert_ray_packet<N>(rays, count, visitor);
+    finish_update();
+}
+
+template <size_t N, typename Visitor>
+void Octray::insert_ray_packet(const RaySegment *rays, const size_t count, Visitor &visitor)
+{
+    static_assert(N > 0 && N <= 32, "packet lanes are tracked in a 32 bit mask");
+
+    RayPacket<N> packet{};
+    PacketInterval<N> interval{};
+    uint32_t active = 0;
+    for (size_t lane = 0; lane < N; ++lane)
+    {
+        TraversalRay ray{};
+        float t0[3] = {0.0f, 0.0f, 0.0f}, t1[3] = {0.0f, 0.0f, 0.0f};
+        if (lane < count)
+        {
+            if (setup_ray(rays[lane].start, rays[lane].end, ray, t0, t1))
+                active |= 1u << lane;
+            else
+                visitor.on_miss(OctreeKey{}, 0);
+        }
+        packet.set_lane(lane, ray);
+        interval.set_lane(lane, t0, t1);
+    }
+
+    if (active)
+        process_packet(this, OctreeKey{}, 0, interval, packet, active, arena, visitor);
+}
+
+template <size_t N, typename Visitor>
+void Octray::process_packet(OctrayNode *node, const OctreeKey &key, const size_t depth, const PacketInterval<N> &interval, const RayPacket<N> &packet,
+                            const uint32_t active, NodeArena<OctrayNode> &node_arena, Visitor &visitor)
+{
+    OCTRAY_COUNT(NODES_VISITED, 1);
+    OCTRAY_MAX(MAX_TRAVERSAL_DEPTH, depth);
+    if (depth >= max_depth)
+    {
+        for (size_t lane = 0; lane < N; ++lane)
+        {
+            if (!(active & (1u << lane)))
+                continue;
+            float t_exit = std::min(std::min(interval.t1[0][lane], interval.t1[1][lane]), interval.t1[2][lane]);
+            int intersection = t_exit >= 1.0f ? END_POINT_INSIDE : PASSES_THROUGH;
+            update_leaf(node, intersection);
+            visitor.on_leaf(key, depth, intersection);
+        }
+        return;
+    }
+
+    // Mid-plane crossings and the 8-child test per active lane, the crossings computed as the
+    // single ray walk computes them, the children regrouped as the lanes crossing each child
+    float tm[3][N] = {};
+    uint32_t child_lanes[8] = {};
+    uint32_t lane_children[N] = {};
+    for (size_t lane = 0; lane < N; ++lane)
+    {
+        if (!(active & (1u << lane)))
+            continue;
+        const float t0[3] = {interval.t0[0][lane], interval.t0[1][lane], interval.t0[2][lane]};
+        const float t1[3] = {interval.t1[0][lane], interval.t1[1][lane], interval.t1[2][lane]};
+        float lane_tm[3];
+        mid_crossings(key, depth, t0, t1, packet.rays[lane], lane_tm);
+        for (int i = 0; i < 3; ++i)
+            tm[i][lane] = lane_tm[i];
+        float entry[8];
+        uint32_t mask = intersect_children(t0, lane_tm, t1, entry);
+        OCTRAY_COUNT(CHILD_INTERVAL_TESTS, 1);
+
+        // Undo the lane's mirroring, which permutes the children by XOR
+        const int mirror = packet.rays[lane].mirror;
+        if (mirror & 1)
+            mask = ((mask & 0x55) << 1) | ((mask & 0xAA) >> 1);
+        if (mirror & 2)
+            mask = ((mask & 0x33) << 2) | ((mask & 0xCC) >> 2);
+        if (mirror & 4)
+            mask = ((mask & 0x0F) << 4) | ((mask & 0xF0) >> 4);
+
+        lane_children[lane] = mask;
+        for (int c = 0; c < 8; ++c)
+            child_lanes[c] |= ((mask >> c) & 1u) << lane;
+    }
+
+    for (int c = 0; c < 8; ++c)
+    {
+        const uint32_t lanes = child_lanes[c];
+        if (!lanes)
+            continue;
+
+        OctrayNode *child_node = create_child(node, c, node_arena);
+        const uint32_t rest = lanes & (lanes - 1);
+        if (!(rest & (rest - 1)))
+        {
+            // One or two rays have lost coherence with the packet; the single ray walk is cheaper
+            for (size_t lane = 0; lane < N; ++lane)
+            {
+                if (!(lanes & (1u << lane)))
+                    continue;
+                const TraversalRay &ray = packet.rays[lane];
+                float t0[3], t1[3];
+                for (int i = 0; i < 3; ++i)
+                {
+                    bool upper = (c ^ ray.mirror) & (1 << i);
+                    t0[i] = upper ? tm[i][lane] : interval.t0[i][lane];
+                    t1[i] = upper ? interval.t1[i][lane] : tm[i][lane];
+                }
+                process_subtree(child_node, key.child(c), depth + 1, t0, t1, ray, node_arena, visitor);
+            }
+            continue;
+        }
+
+        PacketInterval<N> child;
+        for (int i = 0; i < 3; ++i)
+        {
+            for (size_t lane = 0; lane < N; ++lane)
+            {
+                bool upper = (c ^ packet.rays[lane].mirror) & (1 << i);
+                child.t0[i][lane] = upper ? tm[i][lane] : interval.t0[i][lane];
+                child.t1[i][lane] = upper ? interval.t1[i][lane] : tm[i][lane];
+            }
+        }
+        process_packet(child_node, key.child(c), depth + 1, child, packet, lanes, node_arena, visitor);
+    }
+    update_inner(node, node_arena);
+
+    // Misses are reported per ray, exactly as a single ray traversal would
+    for (size_t lane = 0; lane < N; ++lane)
+    {
+        if (!(active & (1u << lane)))
+            continue;
+        for (int c = 0; c < 8; ++c)
+        {
+            if (!(lane_children[lane] & (1u << c)))
+                visitor.on_miss(key.child(c), depth + 1);
+        }
+    }
+}
+
+template <typename Collect>
+void Octray::for_each_leaf_on_segment(const Vec3f &min_corner, const float size, const size_t depth, const Vec3f &start, const Vec3f &end, Collect &&collect)
+{
+    // In units of leaf cells from the root's min corner. Double, since leaf coordinates
+    // reach 2^21 at MAX_DEPTH_LIMIT.
+    const double cells = static_cast<double>(uint64_t{1} << depth);
+    const double scale = cells / size;
+    const double s[3] = {(start.x - min_corner.x) * scale, (start.y - min_corner.y) * scale, (start.z - min_corner.z) * scale};
+    const double e[3] = {(end.x - min_corner.x) * scale, (end.y - min_corner.y) * scale, (end.z - min_corner.z) * scale};
+    double d[3];
+
+    // Clip the segment to the root
+    double t_enter = 0.0, t_exit = 1.0;
+    for (int i = 0; i < 3; ++i)
+    {
+        d[i] = e[i] - s[i];
+        if (d[i] == 0.0)
+        {
+            if (s[i] < 0.0 || s[i] > cells)
+                return;
+            continue;
+        }
+        double near = -s[i] / d[i];
+        double far = (cells - s[i]) / d[i];
+        if (near > far)
+            std::swap(near, far);
+        t_enter = std::max(t_enter, near);
+        t_exit = std::min(t_exit, far);
+    }
+    if (t_enter > t_exit)
+        return;
+
+    const int64_t last_cell = static_cast<int64_t>(cells) - 1;
+    int64_t cell[3], last[3], step[3];
+    double t_max[3], t_delta[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        cell[i] = std::clamp(static_cast<int64_t>(std::floor(s[i] + d[i] * t_enter)), int64_t{0}, last_cell);
+        last[i] = std::clamp(static_cast<int64_t>(std::floor(s[i] + d[i] * t_exit)), int64_t{0}, last_cell);
+        step[i] = d[i] > 0.0 ? 1 : d[i] < 0.0 ? -1 : 0;
+        t_delta[i] = step[i] ? step[i] / d[i] : std::numeric_limits<double>::infinity();
+        t_max[i] = step[i] ? (static_cast<double>(cell[i] + (step[i] > 0)) - s[i]) / d[i] : std::numeric_limits<double>::infinity();
+    }
+
+    while (true)
+    {
+        collect(OctreeKey{static_cast<uint32_t>(cell[0]), static_cast<uint32_t>(cell[1]), static_cast<uint32_t>(cell[2])});
+        if (cell[0] == last[0] && cell[1] == last[1] && cell[2] == last[2])
+            return;
+
+        int axis = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+        // Rounding can leave the last cell off the path, stop at the end of the segment regardless
+        if (t_max[axis] > t_exit)
+            return;
+        cell[axis] += step[axis];
+        t_max[axis] += t_delta[axis];
+        if (cell[axis] < 0 || cell[axis] > last_cell)
+            return;
+    }
+}
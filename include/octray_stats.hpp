@@ -0,0 +1,150 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+
+// Process wide performance counters for the octree's hot paths. Each thread counts into its
+// own slots, so counting is a plain load and store with no contention; collect() sums every
+// thread's slots, including those of threads that have exited.
+//
+// The OCTRAY_COUNT, OCTRAY_GAUGE_ADD, OCTRAY_MAX and OCTRAY_TIME_SCOPE macros are how the
+// library counts. Unless OCTRAY_ENABLE_STATS is defined to 1 (the CMake option of the same
+// name) they expand to nothing, and collect() returns zeros.
+#ifndef OCTRAY_ENABLE_STATS
+#define OCTRAY_ENABLE_STATS 0
+#endif
+
+class OctrayStats
+{
+public:
+    static constexpr bool ENABLED = OCTRAY_ENABLE_STATS;
+
+    enum Counter
+    {
+        NODES_VISITED,        // by the insertion and cast_ray traversals
+        CHILD_INTERVAL_TESTS, // 8-child slab tests, one per lane in a packet
+        LEAF_UPDATES,
+        NODES_SPLIT,     // leaves given a children block
+        PRUNED_EXPANDED, // pruned nodes split back into 8 leaves
+        PRUNES,
+        BLOCKS_COPIED, // copy on write of blocks a snapshot can reach
+        BLOCKS_ALLOCATED,
+        BLOCKS_FREED,
+        INSTANCES_WRITTEN,  // instance buffer slots written
+        SUBTREES_COLLAPSED, // by the memory budget
+        COUNTER_COUNT
+    };
+
+    // Sums of signed changes, so allocating on one thread and freeing on another balances out
+    enum Gauge
+    {
+        BYTES_IN_USE,   // arena blocks handed out
+        BYTES_RESERVED, // arena chunks
+        GAUGE_COUNT
+    };
+
+    // Largest value seen
+    enum Maximum
+    {
+        MAX_TRAVERSAL_DEPTH, // deepest node any traversal reached, wherever it stopped
+        MAXIMUM_COUNT
+    };
+
+    enum Timer
+    {
+        TIME_ACCUMULATE_RAYS,
+        TIME_INSERT_SCAN,
+        TIME_QUERY_POINTS,
+        TIME_PUBLISH,
+        TIME_INSTANCE_UPDATE,
+        TIMER_COUNT
+    };
+
+    struct Totals
+    {
+        uint64_t counters[COUNTER_COUNT] = {};
+        int64_t gauges[GAUGE_COUNT] = {};
+        uint64_t maximums[MAXIMUM_COUNT] = {};
+        uint64_t timer_nanoseconds[TIMER_COUNT] = {};
+        uint64_t timer_calls[TIMER_COUNT] = {};
+    };
+
+    // Every thread's counts merged, counters and timers since the last reset()
+    static Totals collect();
+    // Restarts counters, timers and maximums; gauges keep their level
+    static void reset();
+
+    // One JSON object of name: value
+    static void write_json(std::ostream &out, const Totals &totals);
+    // Prometheus text exposition format, names prefixed octray_
+    static void write_prometheus(std::ostream &out, const Totals &totals);
+
+    static void count(const Counter counter, const uint64_t n) { bump(local().counters[counter], n); }
+    static void gauge_add(const Gauge gauge, const int64_t delta) { bump(local().gauges[gauge], static_cast<uint64_t>(delta)); }
+    static void at_least(const Maximum maximum, const uint64_t value)
+    {
+        std::atomic<uint64_t> &slot = local().maximums[maximum];
+        if (value > slot.load(std::memory_order_relaxed))
+            slot.store(value, std::memory_order_relaxed);
+    }
+
+    class ScopedTimer
+    {
+    public:
+        explicit ScopedTimer(const Timer _timer) : timer(_timer), start(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer()
+        {
+            const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+            ThreadSlots &slots = local();
+            bump(slots.timer_nanoseconds[timer], static_cast<uint64_t>(elapsed.count()));
+            bump(slots.timer_calls[timer], 1);
+        }
+
+    private:
+        Timer timer;
+        std::chrono::steady_clock::time_point start;
+    };
+
+    // One thread's counts, written only by it and read by collect(), hence atomic but never contended
+    struct ThreadSlots
+    {
+        std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+        std::atomic<uint64_t> gauges[GAUGE_COUNT] = {}; // two's complement sums
+        std::atomic<uint64_t> maximums[MAXIMUM_COUNT] = {};
+        std::atomic<uint64_t> timer_nanoseconds[TIMER_COUNT] = {};
+        std::atomic<uint64_t> timer_calls[TIMER_COUNT] = {};
+    };
+
+private:
+    // A trivially constructed thread_local pointer costs no initialization check once set
+    static ThreadSlots &local()
+    {
+        thread_local ThreadSlots *slots = nullptr;
+        if (!slots)
+            slots = &register_thread();
+        return *slots;
+    }
+    static ThreadSlots &register_thread();
+
+    // Single writer, so no read-modify-write instruction is needed
+    static void bump(std::atomic<uint64_t> &slot, const uint64_t n)
+    {
+        slot.store(slot.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+#if OCTRAY_ENABLE_STATS
+#define OCTRAY_STATS_CONCAT_(a, b) a##b
+#define OCTRAY_STATS_CONCAT(a, b) OCTRAY_STATS_CONCAT_(a, b)
+#define OCTRAY_COUNT(counter, n) OctrayStats::count(OctrayStats::counter, (n))
+#define OCTRAY_GAUGE_ADD(gauge, delta) OctrayStats::gauge_add(OctrayStats::gauge, static_cast<int64_t>(delta))
+#define OCTRAY_MAX(maximum, value) OctrayStats::at_least(OctrayStats::maximum, (value))
+#define OCTRAY_TIME_SCOPE(timer) OctrayStats::ScopedTimer OCTRAY_STATS_CONCAT(octray_scoped_timer_, __LINE__)(OctrayStats::timer)
+#else
+#define OCTRAY_COUNT(counter, n) ((void)0)
+#define OCTRAY_GAUGE_ADD(gauge, delta) ((void)0)
+#define OCTRAY_MAX(maximum, value) ((void)0)
+#define OCTRAY_TIME_SCOPE(timer) ((void)0)
+#endif
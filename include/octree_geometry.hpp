@@ -0,0 +1,123 @@
+#pragma once
+
+#include "child_intervals.hpp"
+#include "octree_key.hpp"
+#include "octray_stats.hpp"
+#include "vectors.hpp"
+
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
+// Bounds of an octree and the ray traversal over its cells, independent of how the nodes are
+// stored. Octray and FrozenOctray walk their own nodes with it, so both cast identically.
+class OctreeGeometry
+{
+public:
+    struct TraversalRay
+    {
+        float origin[3];  // ray start, mirrored so the direction is non-negative on every non-parallel axis
+        float inv_dir[3]; // 0 on parallel axes
+        bool parallel[3]; // axes the ray does not move along, never mirrored
+        int mirror;       // child index bits flipped by the mirroring
+    };
+
+    OctreeGeometry(const Vec3f &_center, const float _size, const size_t _max_depth);
+
+    size_t get_max_depth() const { return max_depth; }
+    Vec3f node_center(const OctreeKey &key, const size_t depth) const;
+    float node_size(const size_t depth) const { return std::ldexp(size, -static_cast<int>(depth)); }
+
+    // Key of the cell at depth containing point; false if it is outside the octree
+    bool key_at(const Vec3f &point, const size_t depth, OctreeKey &key) const { return key_at(min_corner, size, point, depth, key); }
+    static bool key_at(const Vec3f &min_corner, const float size, const Vec3f &point, const size_t depth, OctreeKey &key);
+
+    // Root interval of the segment; false if it misses the octree
+    bool setup_ray(const Vec3f &ray_start, const Vec3f &ray_end, TraversalRay &ray, float t0[3], float t1[3]) const;
+    // Interval of any node, computed directly rather than by descending
+    void node_interval(const TraversalRay &ray, const OctreeKey &key, const size_t depth, float t0[3], float t1[3]) const;
+
+    // Mid-plane crossings of a node's interval. Parallel axes never cross, so they sit on one
+    // side for the whole ray: the crossing is -inf or +inf by the side the origin is on
+    void mid_crossings(const OctreeKey &key, const size_t depth, const float t0[3], const float t1[3], const TraversalRay &ray, float tm[3]) const;
+
+    // Calls visit(child, c0, c1) for each child crossed by the segment, front to back.
+    // Returns the mask of visited children. A visit returning true ends the walk early.
+    template <typename Visit>
+    int for_each_child_on_ray(const OctreeKey &key, const size_t depth, const float t0[3], const float t1[3], const TraversalRay &ray, Visit &&visit) const;
+
+protected:
+    const Vec3f center;
+    const float size;
+    const Vec3f min_corner;
+    const size_t max_depth;
+};
+
+inline void OctreeGeometry::mid_crossings(const OctreeKey &key, const size_t depth, const float t0[3], const float t1[3], const TraversalRay &ray,
+                                          float tm[3]) const
+{
+    constexpr float infinity = std::numeric_limits<float>::infinity();
+
+    for (int i = 0; i < 3; ++i)
+        tm[i] = 0.5f * (t0[i] + t1[i]);
+    if (ray.parallel[0] | ray.parallel[1] | ray.parallel[2])
+    {
+        // Parallel axes are never mirrored, so the origin compares with the plane as is
+        const Vec3f mid = node_center(key, depth);
+        const float mid_planes[3] = {mid.x, mid.y, mid.z};
+        for (int i = 0; i < 3; ++i)
+        {
+            if (ray.parallel[i])
+                tm[i] = ray.origin[i] < mid_planes[i] ? infinity : -infinity;
+        }
+    }
+}
+
+template <typename Visit>
+int OctreeGeometry::for_each_child_on_ray(const OctreeKey &key, const size_t depth, const float t0[3], const float t1[3], const TraversalRay &ray,
+                                          Visit &&visit) const
+{
+    float tm[3];
+    mid_crossings(key, depth, t0, t1, ray, tm);
+
+    // Every child overlapping the segment, visited in order of entry
+    float entry[8];
+    int overlap = intersect_children(t0, tm, t1, entry);
+    OCTRAY_COUNT(CHILD_INTERVAL_TESTS, 1);
+
+    int order[8];
+    int count = 0;
+    for (int c = 0; c < 8; ++c)
+    {
+        if (!(overlap & (1 << c)))
+            continue;
+        int j = count++;
+        for (; j > 0 && entry[order[j - 1]] > entry[c]; --j)
+            order[j] = order[j - 1];
+        order[j] = c;
+    }
+
+    int hit_mask = 0;
+    for (int n = 0; n < count; ++n)
+    {
+        int curr = order[n];
+        float c0[3], c1[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            bool upper = curr & (1 << i);
+            c0[i] = upper ? tm[i] : t0[i];
+            c1[i] = upper ? t1[i] : tm[i];
+        }
+
+        int child = curr ^ ray.mirror;
+        hit_mask |= 1 << child;
+        if constexpr (std::is_same_v<decltype(visit(child, c0, c1)), bool>)
+        {
+            if (visit(child, c0, c1))
+                break;
+        }
+        else
+            visit(child, c0, c1);
+    }
+    return hit_mask;
+}
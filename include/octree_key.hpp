@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+// Integer cell coordinates of a node at a given depth. Along each axis, cell k at
+// depth d covers [k, k + 1) * root_size / 2^d measured from the root's min corner.
+struct OctreeKey
+{
+    uint32_t x = 0, y = 0, z = 0;
+
+    // Child i sits in the upper half along x, y, z when bit 0, 1, 2 is set
+    OctreeKey child(int i) const
+    {
+        return {2 * x + (i & 1), 2 * y + ((i >> 1) & 1), 2 * z + ((i >> 2) & 1)};
+    }
+
+    OctreeKey parent() const
+    {
+        return {x >> 1, y >> 1, z >> 1};
+    }
+
+    // The node the given number of levels above this one
+    OctreeKey ancestor(int levels) const
+    {
+        return {x >> levels, y >> levels, z >> levels};
+    }
+
+    // Index of this node among its siblings
+    int child_index() const
+    {
+        return (x & 1) | ((y & 1) << 1) | ((z & 1) << 2);
+    }
+
+    // Interleaved x, y, z bits, so the code's low 3 bits are child_index(). Sorting by
+    // it gives depth first order, and the 21 bit keys of MAX_DEPTH_LIMIT fit in 63 bits.
+    uint64_t morton_code() const
+    {
+        return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+    }
+
+    bool operator==(const OctreeKey &other) const
+    {
+        return x == other.x && y == other.y && z == other.z;
+    }
+
+    bool operator!=(const OctreeKey &other) const
+    {
+        return !(*this == other);
+    }
+
+private:
+    // Moves the low 21 bits of v to every third bit
+    static uint64_t spread_bits(uint64_t v)
+    {
+        v &= 0x1FFFFF;
+        v = (v | v << 32) & 0x001F00000000FFFFull;
+        v = (v | v << 16) & 0x001F0000FF0000FFull;
+        v = (v | v << 8) & 0x100F00F00F00F00Full;
+        v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+        v = (v | v << 2) & 0x1249249249249249ull;
+        return v;
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Set of packed keys (OctreeKey::morton_code) with open addressing and linear probing.
+// One flat array and no per-entry allocation, so it can be cleared and refilled every
+// scan without touching the allocator once it has grown to the scan size.
+class OctreeKeySet
+{
+public:
+    explicit OctreeKeySet(const size_t expected = 0) { reserve(expected); }
+
+    // False if code was already present
+    bool insert(const uint64_t code)
+    {
+        if ((count + 1) * 2 > slots.size())
+            rehash(std::max<size_t>(MIN_SLOTS, slots.size() * 2));
+
+        for (size_t i = slot_of(code);; i = (i + 1) & (slots.size() - 1))
+        {
+            if (slots[i] == code)
+                return false;
+            if (slots[i] == EMPTY)
+            {
+                slots[i] = code;
+                count++;
+                return true;
+            }
+        }
+    }
+
+    bool contains(const uint64_t code) const
+    {
+        if (slots.empty())
+            return false;
+        for (size_t i = slot_of(code);; i = (i + 1) & (slots.size() - 1))
+        {
+            if (slots[i] == code)
+                return true;
+            if (slots[i] == EMPTY)
+                return false;
+        }
+    }
+
+    // Room for expected codes without growing
+    void reserve(const size_t expected)
+    {
+        size_t wanted = MIN_SLOTS;
+        while (wanted < expected * 2)
+            wanted *= 2;
+        if (wanted > slots.size())
+            rehash(wanted);
+    }
+
+    // Empties the set, keeping its capacity
+    void clear()
+    {
+        if (count)
+            std::fill(slots.begin(), slots.end(), EMPTY);
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+
+    // Calls f(code) for each code, in no particular order
+    template <typename F>
+    void for_each(F &&f) const
+    {
+        for (uint64_t code : slots)
+        {
+            if (code != EMPTY)
+                f(code);
+        }
+    }
+
+private:
+    static constexpr uint64_t EMPTY = ~uint64_t{0}; // never a morton code, those use 63 bits
+    static constexpr size_t MIN_SLOTS = 64;
+
+    // Fibonacci hashing of the 4x4x4 brick a key is in, with the key's place in the brick as
+    // the low bits. A ray's consecutive keys then mostly land in the same few cache lines.
+    size_t slot_of(const uint64_t code) const
+    {
+        const size_t brick = static_cast<size_t>(((code >> 6) * 0x9E3779B97F4A7C15ull) >> shift);
+        return (brick & ~size_t{63}) | static_cast<size_t>(code & 63);
+    }
+
+    void rehash(const size_t slot_count)
+    {
+        std::vector<uint64_t> old(slot_count, EMPTY);
+        old.swap(slots);
+        shift = 64;
+        for (size_t n = slot_count; n > 1; n >>= 1)
+            shift--;
+
+        count = 0;
+        for (uint64_t code : old)
+        {
+            if (code != EMPTY)
+                insert(code);
+        }
+    }
+
+    std::vector<uint64_t> slots;
+    size_t count = 0;
+    int shift = 64;
+};
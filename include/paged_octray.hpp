@@ -0,0 +1,208 @@
+#pragma once
+
+#include "octray_node.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// An octree larger than memory, cut at page_depth into subtree pages kept in a page file and
+// loaded on demand into a cache of bounded size. Each page is an Octray of its own cell, stored
+// in the format of octray_file_format.hpp. A top tree down to page_depth holds every page's
+// aggregate, so coarse queries, and casts through pages with nothing occupied, load nothing.
+//
+// A background thread writes back evicted pages that changed, and reads ahead the pages a
+// batch of rays is about to reach. The page file is scratch space, truncated when opened and
+// removed on destruction. Images are stored in power of two slots, reused once superseded, so
+// the file stays within about twice the size of the pages it holds.
+//
+// Updates and queries are the ones of Octray, called from one thread. Pruning stops at page
+// boundaries, so a uniform region spanning several pages is reported page by page.
+class PagedOctray
+{
+public:
+    // cache_bytes bounds the pages in memory, as counted by Octray::bytes_reserved(); each page
+    // holds at least one arena chunk, so pages should have enough levels to fill one. Throws
+    // std::invalid_argument unless page_depth <= max_depth, std::runtime_error if the page file
+    // cannot be created.
+    PagedOctray(const std::string &_page_path, const Vec3f &_center, const float _size, const size_t _max_depth, const size_t _page_depth,
+                const size_t _cache_bytes);
+    ~PagedOctray();
+
+    PagedOctray(const PagedOctray &) = delete;
+    PagedOctray &operator=(const PagedOctray &) = delete;
+
+    // Applies to later updates only. Throws std::invalid_argument unless clamp_min < 0 < clamp_max,
+    // hit > 0 and miss < 0.
+    void set_occupancy_params(const Octray::OccupancyParams &params);
+    const Octray::OccupancyParams &get_occupancy_params() const { return occupancy; }
+
+    // Rays one at a time need every page around the sensor to fit in the cache, or pages are
+    // written back and loaded again ray after ray
+    void accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end);
+    // Rays are grouped by the pages they cross, so each page is loaded once per batch. Each
+    // leaf still sees its rays in array order.
+    void accumulate_rays(const RaySegment *rays, const size_t count);
+
+    // As on Octray, loading the pages they reach. Nodes returned or visited belong to the cache
+    // and are only valid until the next call on the PagedOctray. Page file errors, those of the
+    // background thread included, are thrown as std::runtime_error by the next call to load or
+    // evict a page.
+    const OctrayNode *search(const Vec3f &point, const size_t query_depth = Octray::MAX_DEPTH_LIMIT);
+    bool cast_ray(const Vec3f &origin, const Vec3f &direction, const float max_range, Octray::RayHit &hit,
+                  const size_t query_depth = Octray::MAX_DEPTH_LIMIT);
+    template <typename Visit>
+    void query_box(const Vec3f &box_min, const Vec3f &box_max, Visit &&visit, const size_t query_depth = Octray::MAX_DEPTH_LIMIT);
+
+    bool is_occupied(const OctrayNode &node) const { return node.get_log_odds() > occupancy.occupied_threshold; }
+
+    struct PageStats
+    {
+        size_t resident = 0;
+        size_t resident_bytes = 0;
+        size_t loads = 0;         // pages read back into the cache
+        size_t prefetch_hits = 0; // loads the background thread had already read
+        size_t evictions = 0;
+        size_t writes = 0; // page images written to the file
+        size_t file_bytes = 0;
+    };
+    PageStats page_stats() const;
+
+    size_t get_max_depth() const { return max_depth; }
+    size_t get_page_depth() const { return page_depth; }
+    Vec3f node_center(const OctreeKey &key, const size_t depth) const { return top.node_center(key, depth); }
+    float node_size(const size_t depth) const { return top.node_size(depth); }
+
+private:
+    // Pages read ahead one batch may hold at most, and how far ahead of its updates they are read
+    static constexpr size_t MAX_PREFETCHED = 16;
+    static constexpr size_t PREFETCH_PAGES = 4;
+    static constexpr uint64_t MIN_SLOT_BYTES = 4096;
+
+    struct Page
+    {
+        std::unique_ptr<Octray> tree;
+        size_t bytes = 0; // tree->bytes_reserved() as last counted
+        bool dirty = false;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    struct Extent
+    {
+        uint64_t offset;
+        uint64_t bytes;
+        uint64_t version; // counts writes, as a slot can hold several pages over time
+    };
+
+    // A page image to append, or with no image a page to read ahead
+    struct IoRequest
+    {
+        uint64_t code;
+        std::shared_ptr<const std::string> image;
+    };
+
+    struct Prefetched
+    {
+        uint64_t version; // of the extent it was read from, stale once the page is written again
+        std::string image;
+        uint64_t sequence;
+    };
+
+    // Key of a node at depth within the page at page_key, in the whole octree
+    static OctreeKey global_key(const OctreeKey &page_key, const OctreeKey &key, const size_t depth)
+    {
+        const int levels = static_cast<int>(depth);
+        return {page_key.x << levels | key.x, page_key.y << levels | key.y, page_key.z << levels | key.z};
+    }
+
+    // The resident page, loading it if it was written out. Otherwise a new empty page if create,
+    // else nullptr. Either way it becomes the most recently used.
+    Octray *find_page(const OctreeKey &key, const bool create);
+    std::unique_ptr<Octray> load(const uint64_t code);
+    // Recounts a page's memory after an update and marks it to be written back
+    void page_updated(const uint64_t code);
+    // Evicts least recently used pages other than keep until the cache fits
+    void shrink_cache(const uint64_t keep);
+    void write_back(const uint64_t code, const Octray &tree);
+    void prefetch(const OctreeKey &key);
+
+    static uint64_t slot_bytes(const uint64_t bytes)
+    {
+        uint64_t slot = MIN_SLOT_BYTES;
+        while (slot < bytes)
+            slot <<= 1;
+        return slot;
+    }
+
+    void io_loop();
+    void read_extent(std::ifstream &in, const Extent &extent, std::string &image) const;
+
+    const std::string page_path;
+    const size_t max_depth;
+    const size_t page_depth;
+    const size_t cache_bytes;
+    Octray::OccupancyParams occupancy;
+
+    // Leaves at page_depth hold each observed page's root log odds, unclamped
+    Octray top;
+
+    std::unordered_map<uint64_t, Page> resident;
+    std::list<uint64_t> lru; // codes of resident pages, most recently used first
+    size_t resident_bytes = 0;
+    size_t loads = 0;
+    size_t evictions = 0;
+
+    // Shared with the background thread, under io_mutex
+    mutable std::mutex io_mutex;
+    std::condition_variable io_wake;     // requests queued, or stopping
+    std::condition_variable io_progress; // a request done
+    std::deque<IoRequest> requests;
+    std::unordered_map<uint64_t, std::shared_ptr<const std::string>> pending; // newest image of each page being written
+    size_t pending_bytes = 0;
+    std::unordered_map<uint64_t, Extent> index; // where each written page's newest image is
+    std::unordered_map<uint64_t, Prefetched> prefetched;
+    std::deque<std::pair<uint64_t, uint64_t>> prefetch_order; // code and sequence, oldest first
+    uint64_t prefetch_sequence = 0;
+    size_t prefetch_hits = 0;
+    size_t writes = 0;
+    size_t file_bytes = 0;
+    std::unordered_map<uint64_t, std::vector<uint64_t>> free_slots; // offsets by slot size, for the background thread
+    std::exception_ptr io_error;
+    bool stopping = false;
+
+    std::ofstream page_file;       // written by the background thread only
+    std::ifstream reader;          // for loads
+    std::ifstream prefetch_reader; // for the background thread's reads
+    std::thread io_thread;
+};
+
+template <typename Visit>
+void PagedOctray::query_box(const Vec3f &box_min, const Vec3f &box_max, Visit &&visit, const size_t query_depth)
+{
+    if (query_depth <= page_depth)
+    {
+        top.query_box(box_min, box_max, visit, query_depth);
+        return;
+    }
+
+    std::vector<OctreeKey> pages;
+    top.query_box(box_min, box_max, [&](const OctrayNode &, const OctreeKey &key, const size_t)
+                  { pages.push_back(key); }, page_depth);
+    for (const OctreeKey &page_key : pages)
+    {
+        Octray *tree = find_page(page_key, false);
+        if (!tree)
+            continue;
+        tree->query_box(box_min, box_max, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                        { visit(node, global_key(page_key, key, depth), page_depth + depth); }, query_depth - page_depth);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads running indexed tasks. Each worker owns a deque of
+// task indices and pops from its back; once it runs dry it steals from the front
+// of the other workers' deques.
+class ThreadPool
+{
+public:
+    // 0 uses one worker per hardware thread
+    explicit ThreadPool(size_t thread_count = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // Runs task(index, worker) for every index in [0, count) and blocks until all
+    // have finished. Returns how many tasks were stolen by a worker they were not
+    // dealt to.
+    size_t parallel_for(size_t count, const std::function<void(size_t, size_t)> &task);
+
+private:
+    struct WorkQueue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    void worker_loop(size_t worker);
+    bool pop_task(size_t worker, size_t &task);
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+
+    std::mutex mutex;
+    std::condition_variable start_cv;
+    std::condition_variable done_cv;
+    const std::function<void(size_t, size_t)> *current_task = nullptr;
+    size_t generation = 0;
+    size_t busy_workers = 0;
+    bool stopping = false;
+
+    std::atomic<size_t> steals{0};
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "vectors.hpp"
+
+#include <cmath>
+#include <limits>
+
+// Camera of an OpenGL view for culling octree cells: the six frustum planes, and the scale
+// that turns a cell's size and distance into its size on screen. No graphics dependencies,
+// so culling can run and be tested headlessly.
+class ViewFrustum
+{
+public:
+    static constexpr int ALL_PLANES = 0x3F;
+
+    // view and projection are column major, as glm stores them; viewport_height is in pixels
+    ViewFrustum(const float view[16], const float projection[16], const float viewport_height)
+    {
+        // Clip space rows of projection * view
+        float rows[4][4];
+        for (int r = 0; r < 4; ++r)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                rows[r][c] = 0.0f;
+                for (int k = 0; k < 4; ++k)
+                    rows[r][c] += projection[k * 4 + r] * view[c * 4 + k];
+            }
+        }
+
+        // Inside is -w <= x, y, z <= w
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            for (int c = 0; c < 4; ++c)
+            {
+                planes[2 * axis][c] = rows[3][c] + rows[axis][c];
+                planes[2 * axis + 1][c] = rows[3][c] - rows[axis][c];
+            }
+        }
+        for (int c = 0; c < 4; ++c)
+            depth_row[c] = rows[3][c];
+
+        // Pixels per unit of size at unit depth, from the vertical scale of the projection
+        pixel_scale = 0.5f * viewport_height * std::fabs(projection[5]);
+    }
+
+    // Planes of mask the axis aligned cube still straddles, 0 once it is inside all of
+    // them, or -1 if it is wholly outside one
+    int cull(const Vec3f &center, const float half_size, const int mask) const
+    {
+        int straddled = 0;
+        for (int p = 0; p < 6; ++p)
+        {
+            if (!(mask & (1 << p)))
+                continue;
+            const float *plane = planes[p];
+            const float distance = plane[0] * center.x + plane[1] * center.y + plane[2] * center.z + plane[3];
+            const float extent = half_size * (std::fabs(plane[0]) + std::fabs(plane[1]) + std::fabs(plane[2]));
+            if (distance + extent < 0.0f)
+                return -1;
+            if (distance - extent < 0.0f)
+                straddled |= 1 << p;
+        }
+        return straddled;
+    }
+
+    // Edge length in pixels of the cube as seen at its nearest point, an upper bound on its
+    // size on screen. Infinite for a cube reaching the camera.
+    float projected_size(const Vec3f &center, const float size) const
+    {
+        const float depth = depth_row[0] * center.x + depth_row[1] * center.y + depth_row[2] * center.z + depth_row[3] -
+                            0.5f * size * (std::fabs(depth_row[0]) + std::fabs(depth_row[1]) + std::fabs(depth_row[2]));
+        if (depth <= 0.0f)
+            return std::numeric_limits<float>::infinity();
+        return size * pixel_scale / depth;
+    }
+
+private:
+    float planes[6][4]; // a, b, c, d of a x + b y + c z + d >= 0 inside
+    float depth_row[4]; // a point's distance in front of the camera, 1 everywhere if orthographic
+    float pixel_scale;
+};
@@ -1,15 +1,15 @@
 #pragma once
 
+#include "cube_instance_visitor.hpp"
+#include "instance_slots.hpp"
+
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <imgui.h>
 #include <backends/imgui_impl_glfw.h>
 #include <backends/imgui_impl_opengl3.h>
 
-#include <glm/glm.hpp>
-#include <glm/gtc/matrix_transform.hpp>
-#include <glm/gtc/type_ptr.hpp>
-
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -43,6 +43,20 @@ constexpr float cube_line_verts[] = {
     -0.5f, 0.5f, -0.5f, -0.5f, -0.5f, -0.5f,
     -0.5f, -0.5f, 0.5f, -0.5f, -0.5f, -0.5f};
 
+// Per instance attributes of the bound VAO, read from the bound GL_ARRAY_BUFFER
+void set_instance_attributes()
+{
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
+                          (void *)(offsetof(CubeInstance, center)));
+    glEnableVertexAttribArray(1);
+    glVertexAttribDivisor(1, 1);
+    // depth and color, read as integers
+    glVertexAttribIPointer(2, 2, GL_UNSIGNED_BYTE, sizeof(CubeInstance),
+                           (void *)(offsetof(CubeInstance, depth)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribDivisor(2, 1);
+}
+
 void generate_buffers(GLuint *VBO_solid, GLuint *VBO_outline,
                       GLuint *VAO_solid, GLuint *VAO_outline,
                       GLuint *instanceVBO_solid, GLuint *instanceVBO_outline,
@@ -63,18 +77,7 @@ void generate_buffers(GLuint *VBO_solid, GLuint *VBO_outline,
 
     glBindBuffer(GL_ARRAY_BUFFER, *instanceVBO_solid);
     glBufferData(GL_ARRAY_BUFFER, solidInstances.size() * sizeof(CubeInstance), solidInstances.data(), GL_STATIC_DRAW);
-    for (int i = 0; i < 4; ++i)
-    {
-        glVertexAttribPointer(
-            i + 1, 4, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
-            (void *)(offsetof(CubeInstance, model) + i * sizeof(glm::vec4)));
-        glEnableVertexAttribArray(i + 1);
-        glVertexAttribDivisor(i + 1, 1);
-    }
-    glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
-                          (void *)(offsetof(CubeInstance, color)));
-    glEnableVertexAttribArray(5);
-    glVertexAttribDivisor(5, 1);
+    set_instance_attributes();
     glBindVertexArray(0);
 
     glBindBuffer(GL_ARRAY_BUFFER, *VBO_outline);
@@ -85,19 +88,56 @@ void generate_buffers(GLuint *VBO_solid, GLuint *VBO_outline,
 
     glBindBuffer(GL_ARRAY_BUFFER, *instanceVBO_outline);
     glBufferData(GL_ARRAY_BUFFER, outlineInstances.size() * sizeof(CubeInstance), outlineInstances.data(), GL_STATIC_DRAW);
-    for (int i = 0; i < 4; ++i)
+    set_instance_attributes();
+    glBindVertexArray(0);
+}
+
+// A VAO drawing the shape in VBO_shape (cube_tri_verts or cube_line_verts) once per instance of
+// an initially empty instance buffer, filled later by upload_instances or stream_instances
+void generate_instance_buffers(GLuint VBO_shape, GLuint *VAO, GLuint *instanceVBO)
+{
+    glGenVertexArrays(1, VAO);
+    glGenBuffers(1, instanceVBO);
+
+    glBindVertexArray(*VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO_shape);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void *)0);
+    glEnableVertexAttribArray(0);
+
+    glBindBuffer(GL_ARRAY_BUFFER, *instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, 0, nullptr, GL_DYNAMIC_DRAW);
+    set_instance_attributes();
+    glBindVertexArray(0);
+}
+
+// Replaces the buffer's contents with instances regenerated this frame
+void stream_instances(GLuint instanceVBO, const std::vector<CubeInstance> &instances)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(CubeInstance), instances.data(), GL_STREAM_DRAW);
+}
+
+// Brings the instance buffer up to date with slots, re-uploading it whole only when it has to
+// grow, otherwise patching the written ranges. Returns the number of instances sent.
+size_t upload_instances(GLuint instanceVBO, InstanceSlots<CubeInstance> &slots, size_t *capacity)
+{
+    const CubeInstance *instances = slots.instances().data();
+    size_t uploaded = 0;
+    glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+    if (slots.slot_count() > *capacity)
     {
-        glVertexAttribPointer(
-            i + 1, 4, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
-            (void *)(offsetof(CubeInstance, model) + i * sizeof(glm::vec4)));
-        glEnableVertexAttribArray(i + 1);
-        glVertexAttribDivisor(i + 1, 1);
+        *capacity = std::max<size_t>(2 * *capacity, std::max<size_t>(slots.slot_count(), 1024));
+        glBufferData(GL_ARRAY_BUFFER, *capacity * sizeof(CubeInstance), nullptr, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, slots.slot_count() * sizeof(CubeInstance), instances);
+        uploaded = slots.slot_count();
+        slots.flush([](size_t, size_t) {});
+        return uploaded;
     }
-    glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, sizeof(CubeInstance),
-                          (void *)(offsetof(CubeInstance, color)));
-    glEnableVertexAttribArray(5);
-    glVertexAttribDivisor(5, 1);
-    glBindVertexArray(0);
+    slots.flush([&](size_t first, size_t count)
+                {
+        glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(CubeInstance), count * sizeof(CubeInstance), instances + first);
+        uploaded += count; });
+    return uploaded;
 }
 
 GLFWwindow *window_init(int width, int height, const char *title)
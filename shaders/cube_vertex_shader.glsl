@@ -1,20 +1,31 @@
 #version 330 core
 
 layout (location = 0) in vec3 aPos;
-layout (location = 1) in mat4 instanceTransform;
-layout (location = 5) in vec3 instanceColor;
+layout (location = 1) in vec3 instanceCenter;
+layout (location = 2) in uvec2 instanceInfo; // depth, color index
 
 uniform mat4 projection;
 uniform mat4 view;
+uniform float rootSize;
+
+// Indexed by CubeColor in cube_instance_visitor.hpp
+const uint HIDDEN = 255u;
+const vec3 palette[4] = vec3[4](
+    vec3(0.0, 1.0, 0.0),
+    vec3(1.0, 0.0, 0.0),
+    vec3(1.0, 1.0, 1.0),
+    vec3(1.0, 0.5, 0.0));
 
 out vec3 color;
 out vec3 fragPos;
 
 void main()
 {
-    vec4 worldPosition = instanceTransform * vec4(aPos, 1.0);
+    // A hidden cube collapses to a point, which draws nothing
+    float scale = instanceInfo.y == HIDDEN ? 0.0 : rootSize * exp2(-float(instanceInfo.x));
+    vec4 worldPosition = vec4(instanceCenter + aPos * scale, 1.0);
     fragPos = vec3(worldPosition);
-    
+
     gl_Position = projection * view * worldPosition;
-    color = instanceColor;
+    color = palette[min(instanceInfo.y, 3u)];
 }
@@ -0,0 +1,198 @@
+#include "brick_grid.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <stdexcept>
+
+BrickGrid::BrickGrid(const Vec3f &_center, const float _size, const size_t _max_depth)
+    : center(_center), size(_size), min_corner(_center - Vec3f{_size, _size, _size} * 0.5f), max_depth(_max_depth)
+{
+    if (max_depth > Octray::MAX_DEPTH_LIMIT)
+        throw std::invalid_argument("BrickGrid max_depth exceeds Octray::MAX_DEPTH_LIMIT");
+}
+
+BrickGrid::BrickGrid(const Octray &octray, const size_t max_cells)
+    : BrickGrid(octray.node_center(OctreeKey{}, 0), octray.node_size(0), octray.get_max_depth())
+{
+    occupancy = octray.get_occupancy_params();
+
+    // A node's cell count, 8^21 at most, fits in 64 bits
+    const Vec3f half{size * 0.5f, size * 0.5f, size * 0.5f};
+    uint64_t cells = 0;
+    bool too_many = false;
+    octray.query_box(center - half, center + half, [&](const OctrayNode &, const OctreeKey &, const size_t depth)
+                     {
+        const uint64_t node_cells = uint64_t{1} << (3 * (max_depth - depth));
+        too_many |= node_cells > max_cells - cells;
+        if (!too_many)
+            cells += node_cells; }, max_depth);
+    if (too_many)
+        throw std::length_error("BrickGrid octray expands to more than max_cells cells");
+
+    octray.query_box(center - half, center + half, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                     {
+        // A pruned node stands for all the cells it covers
+        const int levels = static_cast<int>(max_depth - depth);
+        const uint32_t span = uint32_t{1} << levels;
+        const OctreeKey first{key.x << levels, key.y << levels, key.z << levels};
+        for (uint32_t z = first.z; z < first.z + span; z++)
+        {
+            for (uint32_t y = first.y; y < first.y + span; y++)
+            {
+                for (uint32_t x = first.x; x < first.x + span; x++)
+                    set_cell(OctreeKey{x, y, z}, node.get_log_odds());
+            }
+        } }, max_depth);
+}
+
+void BrickGrid::set_occupancy_params(const Octray::OccupancyParams &params)
+{
+    // Kept to Octray's rule, so to_octray() always has a valid tree to build
+    if (!(params.clamp_min < 0.0f && params.clamp_max > 0.0f))
+        throw std::invalid_argument("BrickGrid occupancy clamp range must contain 0");
+    if (!(params.hit > 0.0f && params.miss < 0.0f))
+        throw std::invalid_argument("BrickGrid occupancy hit must be positive and miss negative");
+    occupancy = params;
+}
+
+void BrickGrid::accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end)
+{
+    OctrayVisitor visitor;
+    accumulate_ray(ray_start, ray_end, visitor);
+}
+
+void BrickGrid::accumulate_rays(const RaySegment *rays, const size_t count)
+{
+    OCTRAY_TIME_SCOPE(TIME_ACCUMULATE_RAYS);
+    OctrayVisitor visitor;
+    for (size_t i = 0; i < count; i++)
+        accumulate_ray(rays[i].start, rays[i].end, visitor);
+}
+
+const float *BrickGrid::find(const OctreeKey &key) const
+{
+    const uint64_t limit = uint64_t{1} << max_depth;
+    if (key.x >= limit || key.y >= limit || key.z >= limit)
+        return nullptr;
+    const Brick *brick = find_brick(brick_code(key));
+    const size_t cell = cell_index(key);
+    if (!brick || !(brick->known[cell / 64] & (uint64_t{1} << (cell % 64))))
+        return nullptr;
+    return &brick->log_odds[cell];
+}
+
+const float *BrickGrid::search(const Vec3f &point) const
+{
+    OctreeKey key;
+    if (!Octray::key_at(min_corner, size, point, max_depth, key))
+        return nullptr;
+    return find(key);
+}
+
+std::unique_ptr<Octray> BrickGrid::to_octray() const
+{
+    auto octray = std::make_unique<Octray>(center, size, max_depth);
+    octray->set_occupancy_params(occupancy);
+
+    std::vector<uint64_t> codes;
+    std::vector<float> values;
+    codes.reserve(cell_count());
+    values.reserve(codes.capacity());
+    for_each_cell([&](const uint64_t code, const float log_odds)
+                  {
+        codes.push_back(code);
+        values.push_back(log_odds); });
+    octray->assign_leaves(codes.data(), values.data(), codes.size());
+    return octray;
+}
+
+void BrickGrid::clear()
+{
+    bricks.clear();
+    std::fill(table.begin(), table.end(), Slot{0, EMPTY});
+    cached_code = ~uint64_t{0};
+    cached_brick = EMPTY;
+}
+
+size_t BrickGrid::cell_count() const
+{
+    size_t count = 0;
+    for (const Brick &brick : bricks)
+    {
+        for (uint64_t word : brick.known)
+            count += std::bitset<64>(word).count();
+    }
+    return count;
+}
+
+const BrickGrid::Brick *BrickGrid::find_brick(const uint64_t code) const
+{
+    if (table.empty())
+        return nullptr;
+    for (size_t i = slot_of(code);; i = (i + 1) & (table.size() - 1))
+    {
+        if (table[i].brick == EMPTY)
+            return nullptr;
+        if (table[i].code == code)
+            return &bricks[table[i].brick];
+    }
+}
+
+BrickGrid::Brick &BrickGrid::brick_at(const OctreeKey &key)
+{
+    const uint64_t code = brick_code(key);
+    if (code == cached_code)
+        return bricks[cached_brick];
+
+    if ((bricks.size() + 1) * 2 > table.size())
+        rehash(std::max(MIN_SLOTS, table.size() * 2));
+
+    size_t i = slot_of(code);
+    while (table[i].brick != EMPTY && table[i].code != code)
+        i = (i + 1) & (table.size() - 1);
+    if (table[i].brick == EMPTY)
+    {
+        table[i] = {code, static_cast<uint32_t>(bricks.size())};
+        Brick &brick = bricks.emplace_back();
+        brick.code = code;
+        std::fill(std::begin(brick.known), std::end(brick.known), uint64_t{0});
+        std::fill(std::begin(brick.log_odds), std::end(brick.log_odds), 0.0f);
+    }
+    cached_code = code;
+    cached_brick = table[i].brick;
+    return bricks[cached_brick];
+}
+
+void BrickGrid::rehash(const size_t slot_count)
+{
+    table.assign(slot_count, Slot{0, EMPTY});
+    shift = 64;
+    for (size_t n = slot_count; n > 1; n >>= 1)
+        shift--;
+
+    for (uint32_t b = 0; b < bricks.size(); b++)
+    {
+        size_t i = slot_of(bricks[b].code);
+        while (table[i].brick != EMPTY)
+            i = (i + 1) & (table.size() - 1);
+        table[i] = {bricks[b].code, b};
+    }
+}
+
+void BrickGrid::update_cell(const OctreeKey &key, const int intersection)
+{
+    Brick &brick = brick_at(key);
+    const size_t cell = cell_index(key);
+    const float delta = intersection == OctrayNode::END_POINT_INSIDE ? occupancy.hit : occupancy.miss;
+    brick.log_odds[cell] = std::clamp(brick.log_odds[cell] + delta, occupancy.clamp_min, occupancy.clamp_max);
+    brick.known[cell / 64] |= uint64_t{1} << (cell % 64);
+    OCTRAY_COUNT(LEAF_UPDATES, 1);
+}
+
+void BrickGrid::set_cell(const OctreeKey &key, const float log_odds)
+{
+    Brick &brick = brick_at(key);
+    const size_t cell = cell_index(key);
+    brick.log_odds[cell] = log_odds;
+    brick.known[cell / 64] |= uint64_t{1} << (cell % 64);
+}
@@ -0,0 +1,130 @@
+#include "frozen_octray.hpp"
+
+#include <algorithm>
+
+std::unique_ptr<FrozenOctray> Octray::freeze() const
+{
+    std::unique_ptr<FrozenOctray> frozen(new FrozenOctray(center, size, max_depth, occupancy));
+
+    // Level by level, so each inner node's children follow those of the inner nodes before it
+    std::vector<const OctrayNode *> level{this};
+    std::vector<const OctrayNode *> next;
+    while (!level.empty())
+    {
+        next.clear();
+        for (const OctrayNode *node : level)
+        {
+            frozen->inner.append(!node->is_leaf(), 1);
+            frozen->log_odds.push_back(node->log_odds);
+            if (node->is_leaf())
+                continue;
+            frozen->masks.append(node->child_mask, 8);
+            for (int c = 0; c < 8; ++c)
+            {
+                if (node->has_child(c))
+                    next.push_back(node->child(c));
+            }
+        }
+        std::swap(level, next);
+    }
+
+    frozen->inner.build_index();
+    frozen->masks.build_index();
+    frozen->log_odds.shrink_to_fit();
+    return frozen;
+}
+
+FrozenOctray::FrozenOctray(const Vec3f &_center, const float _size, const size_t _max_depth, const Octray::OccupancyParams &_occupancy)
+    : geometry(_center, _size, _max_depth), occupancy(_occupancy)
+{
+}
+
+void FrozenOctray::RankBits::build_index()
+{
+    words.shrink_to_fit();
+    blocks.assign(words.size() / BLOCK_WORDS + 1, 0);
+    uint64_t count = 0;
+    for (size_t w = 0; w < words.size(); w++)
+    {
+        if (w % BLOCK_WORDS == 0)
+            blocks[w / BLOCK_WORDS] = count;
+        count += std::bitset<64>(words[w]).count();
+    }
+    if (words.size() % BLOCK_WORDS == 0)
+        blocks.back() = count;
+}
+
+bool FrozenOctray::search(const Vec3f &point, Node &node, const size_t query_depth) const
+{
+    const size_t max_depth = geometry.get_max_depth();
+    const size_t stop_depth = std::min(query_depth, max_depth);
+    OctreeKey key;
+    // A never observed root is the only leaf above max depth that is not pruned
+    if ((!is_inner(0) && max_depth > 0 && log_odds[0] == 0.0f) || !geometry.key_at(point, stop_depth, key))
+        return false;
+
+    size_t index = 0;
+    for (size_t depth = 0; depth < stop_depth; ++depth)
+    {
+        if (!is_inner(index))
+        {
+            if (log_odds[index] == 0.0f)
+                return false;
+            node = {key.ancestor(static_cast<int>(stop_depth - depth)), depth, log_odds[index]};
+            return true;
+        }
+        const int child = key.ancestor(static_cast<int>(stop_depth - depth - 1)).child_index();
+        size_t first;
+        const uint8_t mask = children_of(index, first);
+        if (!(mask & (1 << child)))
+            return false;
+        index = first + children_before(mask, child);
+    }
+    node = {key, stop_depth, log_odds[index]};
+    return true;
+}
+
+bool FrozenOctray::cast_ray(const Vec3f &origin, const Vec3f &direction, const float max_range, Octray::RayHit &hit, const size_t query_depth) const
+{
+    float length = direction.magnitude();
+    if (!(length > 0.0f && max_range > 0.0f))
+        return false;
+
+    OctreeGeometry::TraversalRay ray;
+    float t0[3], t1[3];
+    if (!geometry.setup_ray(origin, origin + direction * (max_range / length), ray, t0, t1))
+        return false;
+    if (!cast_subtree(0, OctreeKey{}, 0, std::min(query_depth, geometry.get_max_depth()), t0, t1, ray, hit))
+        return false;
+
+    // The segment was scaled to t in [0, 1]
+    hit.distance *= max_range;
+    return true;
+}
+
+bool FrozenOctray::cast_subtree(const size_t node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const float t0[3], const float t1[3],
+                                const OctreeGeometry::TraversalRay &ray, Octray::RayHit &hit) const
+{
+    // Inner nodes carry the max of their leaves, so this skips free subtrees whole
+    if (!(log_odds[node] > occupancy.occupied_threshold))
+        return false;
+
+    const bool leaf = !is_inner(node);
+    if (depth >= stop_depth || leaf)
+    {
+        // Only a never observed root is a leaf above max depth without being pruned
+        if (depth < geometry.get_max_depth() && leaf && log_odds[node] == 0.0f)
+            return false;
+        hit = {key, depth, std::max(0.0f, std::max(std::max(t0[0], t0[1]), t0[2]))};
+        return true;
+    }
+
+    size_t first;
+    const uint8_t mask = children_of(node, first);
+    bool found = false;
+    geometry.for_each_child_on_ray(key, depth, t0, t1, ray, [&](int child, const float c0[3], const float c1[3])
+                                   {
+        found = (mask & (1 << child)) && cast_subtree(first + children_before(mask, child), key.child(child), depth + 1, stop_depth, c0, c1, ray, hit);
+        return found; });
+    return found;
+}
@@ -0,0 +1,146 @@
+#include "mapped_octray.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define OCTRAY_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedOctray::MappedOctray(const std::string &path)
+{
+    const unsigned char *data = nullptr;
+    size_t bytes = 0;
+#ifdef OCTRAY_HAS_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("MappedOctray could not open " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0)
+    {
+        close(fd);
+        throw std::runtime_error("MappedOctray could not stat " + path);
+    }
+    bytes = static_cast<size_t>(info.st_size);
+    void *address = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        throw std::runtime_error("MappedOctray could not map " + path);
+    mapping = address;
+    mapping_bytes = bytes;
+    data = static_cast<const unsigned char *>(address);
+#else
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("MappedOctray could not open " + path);
+    buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    bytes = buffer.size();
+    data = buffer.data();
+#endif
+
+    if (bytes >= sizeof(header))
+        std::memcpy(&header, data, sizeof(header));
+    const char *error = bytes >= sizeof(header) ? header.validate(bytes, Octray::MAX_DEPTH_LIMIT) : "octray file is truncated";
+    if (error)
+    {
+        unmap();
+        throw std::runtime_error(std::string("MappedOctray: ") + error);
+    }
+
+    records = data + sizeof(header);
+    min_corner = Vec3f{header.center[0], header.center[1], header.center[2]} - Vec3f{header.size, header.size, header.size} * 0.5f;
+}
+
+MappedOctray::~MappedOctray()
+{
+    unmap();
+}
+
+void MappedOctray::unmap()
+{
+#ifdef OCTRAY_HAS_MMAP
+    if (mapping)
+        munmap(const_cast<void *>(mapping), mapping_bytes);
+#endif
+    mapping = nullptr;
+    records = nullptr;
+}
+
+Vec3f MappedOctray::node_center(const OctreeKey &key, const size_t depth) const
+{
+    float half_size = node_size(depth + 1);
+    return {min_corner.x + static_cast<float>(2 * key.x + 1) * half_size,
+            min_corner.y + static_cast<float>(2 * key.y + 1) * half_size,
+            min_corner.z + static_cast<float>(2 * key.z + 1) * half_size};
+}
+
+bool MappedOctray::search(const Vec3f &point, Node &node, const size_t query_depth) const
+{
+    const size_t max_depth = header.max_depth;
+    const size_t stop_depth = std::min(query_depth, max_depth);
+    OctreeKey key;
+    if (!Octray::key_at(min_corner, header.size, point, stop_depth, key))
+        return false;
+
+    // Each record is checked against the end of its parent's subtree
+    const unsigned char *record = records;
+    const unsigned char *end = records + header.stream_bytes;
+    for (size_t depth = 0;; ++depth)
+    {
+        end = record + subtree_bytes(record, end);
+        const uint8_t mask = record[0];
+        float log_odds;
+        std::memcpy(&log_odds, record + 1, sizeof(float));
+
+        // A leaf above max depth is a pruned region, unless it was never observed
+        if (!mask)
+        {
+            if (depth < max_depth && log_odds == 0.0f)
+                return false;
+            node = {key.ancestor(static_cast<int>(stop_depth - depth)), depth, log_odds};
+            return true;
+        }
+        // Inner records carry the largest log odds below them
+        if (depth >= stop_depth)
+        {
+            node = {key, depth, log_odds};
+            return true;
+        }
+
+        const int child = key.ancestor(static_cast<int>(stop_depth - depth - 1)).child_index();
+        if (!(mask & (1 << child)))
+            return false;
+
+        // Step over the subtrees of the siblings stored before the child
+        record += OctrayFileHeader::INNER_RECORD_BYTES;
+        for (int i = 0; i < child; ++i)
+        {
+            if (mask & (1 << i))
+                record += subtree_bytes(record, end);
+        }
+    }
+}
+
+size_t MappedOctray::subtree_bytes(const unsigned char *record, const unsigned char *end)
+{
+    const size_t available = static_cast<size_t>(end - record);
+    if (available < OctrayFileHeader::LEAF_RECORD_BYTES)
+        throw std::runtime_error("MappedOctray: octray file is corrupt");
+    if (!record[0])
+        return OctrayFileHeader::LEAF_RECORD_BYTES;
+
+    if (available < OctrayFileHeader::INNER_RECORD_BYTES)
+        throw std::runtime_error("MappedOctray: octray file is corrupt");
+    uint64_t below;
+    std::memcpy(&below, record + 1 + sizeof(float), sizeof(below));
+    if (below > available - OctrayFileHeader::INNER_RECORD_BYTES)
+        throw std::runtime_error("MappedOctray: octray file is corrupt");
+    return OctrayFileHeader::INNER_RECORD_BYTES + below;
+}
@@ -1,15 +1,92 @@
 #include "octray_node.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <vector>
 #include <cmath>
+#include <limits>
+#include <stdexcept>
 
-#include <glm/gtc/matrix_transform.hpp>
+namespace
+{
+    constexpr float infinity = std::numeric_limits<float>::infinity();
+
+    struct CodedPoint
+    {
+        uint64_t code;
+        size_t index;
+    };
+
+    // Stable LSD radix sort by bits [low_bit, low_bit + bits) of code(item), in as few passes of
+    // at most 11 bits as cover them. Every pass's histogram is counted in one read up front, and
+    // passes where all items share the digit are skipped.
+    template <typename Item, typename Code>
+    void radix_sort(std::vector<Item> &items, const int low_bit, const int bits, Code &&code)
+    {
+        if (items.empty() || bits <= 0)
+            return;
+        const int passes = (bits + 10) / 11;
+        const int digit_bits = (bits + passes - 1) / passes;
+        const size_t radix = size_t{1} << digit_bits;
+        const uint64_t digit_mask = radix - 1;
+
+        std::vector<size_t> offsets(passes * radix, 0);
+        for (const Item &item : items)
+        {
+            for (int pass = 0; pass < passes; ++pass)
+                offsets[pass * radix + ((code(item) >> (low_bit + digit_bits * pass)) & digit_mask)]++;
+        }
+
+        std::vector<Item> scratch(items.size());
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            const int shift = low_bit + digit_bits * pass;
+            size_t *offset = offsets.data() + pass * radix;
+            if (offset[(code(items.front()) >> shift) & digit_mask] == items.size())
+                continue;
+            size_t total = 0;
+            for (size_t digit = 0; digit < radix; ++digit)
+            {
+                size_t digit_count = offset[digit];
+                offset[digit] = total;
+                total += digit_count;
+            }
+            for (const Item &item : items)
+                scratch[offset[(code(item) >> shift) & digit_mask]++] = item;
+            items.swap(scratch);
+        }
+    }
+}
 
-int OctrayNode::intersects(const Vec3f &ray_start, const Vec3f &ray_end) const
+Octray::Octray(const Vec3f &_center, const float _size, const size_t _max_depth)
+    : OctreeGeometry(_center, _size, _max_depth), reader_slots(new ReaderSlot[MAX_SNAPSHOTS])
 {
-    Vec3f half_size = {size * 0.5f, size * 0.5f, size * 0.5f};
-    Vec3f min = center - half_size;
-    Vec3f max = center + half_size;
+    if (max_depth > MAX_DEPTH_LIMIT)
+        throw std::invalid_argument("Octray max_depth exceeds MAX_DEPTH_LIMIT");
+    arena.set_tag(write_version);
+    occupancy_versions.emplace_back(std::make_unique<const OccupancyParams>(occupancy), FREE_SLOT);
+    published_occupancy.store(occupancy_versions.back().first.get());
+}
+
+void Octray::set_occupancy_params(const OccupancyParams &params)
+{
+    // Pruned nodes are told apart from unobserved ones by a non-zero value
+    if (!(params.clamp_min < 0.0f && params.clamp_max > 0.0f))
+        throw std::invalid_argument("Octray occupancy clamp range must contain 0");
+    if (!(params.hit > 0.0f && params.miss < 0.0f))
+        throw std::invalid_argument("Octray occupancy hit must be positive and miss negative");
+    occupancy = params;
+    occupancy_changed = true;
+}
+
+int Octray::intersects(const OctreeKey &key, const size_t depth, const Vec3f &ray_start, const Vec3f &ray_end) const
+{
+    float half = node_size(depth + 1);
+    Vec3f half_size = {half, half, half};
+    Vec3f node = node_center(key, depth);
+    Vec3f min = node - half_size;
+    Vec3f max = node + half_size;
 
     if (ray_end.inside(min, max))
         return END_POINT_INSIDE;
@@ -42,52 +119,865 @@ int OctrayNode::intersects(const Vec3f &ray_start, const Vec3f &ray_end) const
     return PASSES_THROUGH;
 }
 
-void Octray::accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end, std::vector<CubeInstance> &filledInstances, std::vector<CubeInstance> &outlinedInstances)
+void Octray::accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end)
+{
+    OctrayVisitor visitor;
+    accumulate_ray(ray_start, ray_end, visitor);
+}
+
+void Octray::accumulate_rays(const RaySegment *rays, const size_t count)
+{
+    OCTRAY_TIME_SCOPE(TIME_ACCUMULATE_RAYS);
+    OctrayVisitor visitor;
+    for (size_t i = 0; i < count; i += PACKET_WIDTH)
+        insert_ray_packet<PACKET_WIDTH>(rays + i, std::min(PACKET_WIDTH, count - i), visitor);
+    finish_update();
+}
+
+Octray::BatchStats Octray::accumulate_rays(const RaySegment *rays, const size_t count, ThreadPool &pool)
+{
+    OCTRAY_TIME_SCOPE(TIME_ACCUMULATE_RAYS);
+    using namespace std::chrono;
+    time_point start_time = high_resolution_clock::now();
+
+    BatchStats stats;
+    stats.rays = count;
+    stats.threads = pool.size();
+
+    // Rays are binned by the subtrees they cross at partition_depth. Each subtree is then
+    // a task owned by one worker, so splits never race and no locks are needed below it.
+    const size_t partition_depth = std::min(PARTITION_DEPTH, max_depth);
+    const size_t side = size_t{1} << partition_depth;
+    const size_t subtree_count = side * side * side;
+    const size_t chunk_count = std::min(pool.size(), std::max<size_t>(count, 1));
+
+    std::vector<std::vector<std::vector<uint32_t>>> bins(chunk_count, std::vector<std::vector<uint32_t>>(subtree_count));
+    std::vector<size_t> missed(chunk_count, 0);
+    pool.parallel_for(chunk_count, [&](size_t chunk, size_t)
+                      {
+        size_t begin = count * chunk / chunk_count;
+        size_t end = count * (chunk + 1) / chunk_count;
+        for (size_t r = begin; r < end; r++)
+        {
+            TraversalRay ray;
+            float t0[3], t1[3];
+            if (!setup_ray(rays[r].start, rays[r].end, ray, t0, t1))
+            {
+                missed[chunk]++;
+                continue;
+            }
+            collect_subtrees(OctreeKey{}, 0, partition_depth, t0, t1, ray, [&](const OctreeKey &key)
+                             { bins[chunk][key.x + side * (key.y + side * key.z)].push_back(static_cast<uint32_t>(r)); });
+        } });
+
+    // Create the shared top levels up front, single threaded
+    std::vector<OctrayNode *> subtrees(subtree_count, nullptr);
+    for (size_t s = 0; s < subtree_count; s++)
+    {
+        bool touched = false;
+        for (size_t chunk = 0; chunk < chunk_count; chunk++)
+            touched |= !bins[chunk][s].empty();
+        if (!touched)
+            continue;
+
+        OctreeKey key{static_cast<uint32_t>(s % side), static_cast<uint32_t>(s / side % side), static_cast<uint32_t>(s / (side * side))};
+        OctrayNode *node = this;
+        for (size_t d = partition_depth; d > 0; d--)
+            node = create_child(node, key.ancestor(d - 1).child_index(), arena);
+        subtrees[s] = node;
+    }
+    for (size_t chunk = 0; chunk < chunk_count; chunk++)
+        stats.rays_missed += missed[chunk];
+
+    struct WorkerState : OctrayVisitor
+    {
+        NodeArena<OctrayNode> arena;
+        size_t leaves_visited = 0;
+
+        void on_leaf(const OctreeKey &, const size_t, const int) { leaves_visited++; }
+    };
+    std::vector<WorkerState> workers(pool.size());
+    for (WorkerState &state : workers)
+    {
+        state.arena.set_tag(write_version);
+        state.arena.borrow_from(&arena);
+    }
+
+    stats.tasks = subtree_count;
+    stats.steals = pool.parallel_for(subtree_count, [&](size_t s, size_t worker)
+                                     {
+        if (!subtrees[s])
+            return;
+        WorkerState &state = workers[worker];
+        OctreeKey key{static_cast<uint32_t>(s % side), static_cast<uint32_t>(s / side % side), static_cast<uint32_t>(s / (side * side))};
+
+        // Rays of the bin go down the subtree in packets, in ray order
+        RayPacket<PACKET_WIDTH> packet{};
+        PacketInterval<PACKET_WIDTH> interval{};
+        uint32_t active = 0;
+        size_t lane = 0;
+        auto flush = [&]()
+        {
+            if (active)
+                process_packet(subtrees[s], key, partition_depth, interval, packet, active, state.arena, state);
+            active = 0;
+            lane = 0;
+        };
+
+        for (size_t chunk = 0; chunk < chunk_count; chunk++)
+        {
+            for (uint32_t r : bins[chunk][s])
+            {
+                TraversalRay ray;
+                float t0[3], t1[3];
+                setup_ray(rays[r].start, rays[r].end, ray, t0, t1);
+                node_interval(ray, key, partition_depth, t0, t1);
+
+                packet.set_lane(lane, ray);
+                interval.set_lane(lane, t0, t1);
+                active |= 1u << lane;
+                if (++lane == PACKET_WIDTH)
+                    flush();
+            }
+        }
+        flush(); });
+
+    for (WorkerState &state : workers)
+    {
+        stats.blocks_allocated += state.arena.block_count();
+        stats.leaves_visited += state.leaves_visited;
+        arena.adopt(state.arena);
+    }
+    update_inner_nodes(this, 0, partition_depth);
+    finish_update();
+
+    stats.seconds = duration<double>(high_resolution_clock::now() - start_time).count();
+    return stats;
+}
+
+void Octray::insert_scan(const Vec3f &origin, const Vec3f *points, const size_t count)
+{
+    OCTRAY_TIME_SCOPE(TIME_INSERT_SCAN);
+    free_keys.clear();
+    occupied_keys.clear();
+    for (size_t p = 0; p < count; p++)
+    {
+        for_each_leaf_on_segment(origin, points[p], [&](const OctreeKey &key)
+                                 { free_keys.insert(key.morton_code()); });
+
+        OctreeKey end;
+        if (key_at(points[p], max_depth, end))
+            occupied_keys.insert(end.morton_code());
+    }
+
+    // Occupied wins over free when a cell is both
+    scan_updates.clear();
+    scan_updates.reserve(free_keys.size() + occupied_keys.size());
+    occupied_keys.for_each([&](uint64_t code)
+                           { scan_updates.push_back(code << 1 | 1); });
+    free_keys.for_each([&](uint64_t code)
+                       {
+        if (!occupied_keys.contains(code))
+            scan_updates.push_back(code << 1); });
+    // An empty scan still ends an update call, so it ages the tree like any other
+    if (!scan_updates.empty())
+    {
+        std::sort(scan_updates.begin(), scan_updates.end());
+        apply_updates(this, 0, scan_updates.data(), scan_updates.data() + scan_updates.size());
+    }
+    finish_update();
+}
+
+void Octray::apply_updates(OctrayNode *node, const size_t depth, const uint64_t *begin, const uint64_t *end)
 {
-    std::vector<OctrayNode *> stack;
-    stack.push_back(this);
+    OCTRAY_COUNT(NODES_VISITED, 1);
+    OCTRAY_MAX(MAX_TRAVERSAL_DEPTH, depth);
+    if (depth >= max_depth)
+    {
+        update_leaf(node, (*begin & 1) ? END_POINT_INSIDE : PASSES_THROUGH);
+        return;
+    }
+
+    // Child index bits of this level, below them the deeper levels and the hit bit
+    const int shift = 3 * static_cast<int>(max_depth - depth - 1) + 1;
+    while (begin != end)
+    {
+        const int child = static_cast<int>((*begin >> shift) & 7);
+        const uint64_t *last = begin + 1;
+        while (last != end && static_cast<int>((*last >> shift) & 7) == child)
+            ++last;
+        apply_updates(create_child(node, child, arena), depth + 1, begin, last);
+        begin = last;
+    }
+    update_inner(node, arena);
+}
+
+void Octray::assign_leaves(const uint64_t *codes, const float *log_odds, const size_t count)
+{
+    if (count)
+        assign_leaves(this, 0, codes, codes + count, log_odds);
+    finish_update();
+}
+
+void Octray::assign_leaves(OctrayNode *node, const size_t depth, const uint64_t *begin, const uint64_t *end, const float *log_odds)
+{
+    if (depth >= max_depth)
+    {
+        // Repeated codes leave the last of their values
+        const float value = std::clamp(log_odds[end - begin - 1], occupancy.clamp_min, occupancy.clamp_max);
+        node->changed |= value != node->log_odds;
+        node->log_odds = value;
+        return;
+    }
+
+    const int shift = 3 * static_cast<int>(max_depth - depth - 1);
+    while (begin != end)
+    {
+        const int child = static_cast<int>((*begin >> shift) & 7);
+        const uint64_t *last = begin + 1;
+        while (last != end && static_cast<int>((*last >> shift) & 7) == child)
+            ++last;
+        assign_leaves(create_child(node, child, arena), depth + 1, begin, last, log_odds);
+        log_odds += last - begin;
+        begin = last;
+    }
+    update_inner(node, arena);
+}
+
+void Octray::merge(const Octray &other)
+{
+    check_same_bounds(other);
+    if (&other == this)
+        return;
+    merge_subtree(this, &other, false, true);
+    finish_update();
+}
+
+void Octray::merge(Octray &&other)
+{
+    check_same_bounds(other);
+    if (&other == this)
+        return;
+
+    // Blocks only other's published versions reach are garbage, the rest become this tree's own
+    other.arena.release_deferred(~uint64_t{0});
+    if (const OctrayNode *published = other.published_root.exchange(nullptr))
+        other.arena.free_block(const_cast<OctrayNode *>(published));
+    other.arena.retag(write_version);
+    arena.adopt(other.arena);
+    merge_subtree(this, &other, true, other.changes_taken);
+
+    other.clear_children();
+    other.log_odds = 0.0f;
+    other.changed = true;
+    other.changes_taken = false;
+    finish_update();
+}
+
+void Octray::merge_all(std::vector<std::unique_ptr<Octray>> &trees, ThreadPool &pool)
+{
+    // Checked here, since an exception thrown by a merge on a worker thread would terminate
+    for (const std::unique_ptr<Octray> &tree : trees)
+    {
+        if (!tree)
+            throw std::invalid_argument("Octray::merge_all given a null tree");
+        trees[0]->check_same_bounds(*tree);
+    }
+
+    // Round by round, tree i takes in tree i + stride for every i that is a multiple of 2 stride
+    for (size_t stride = 1; stride < trees.size(); stride *= 2)
+    {
+        const size_t pairs = (trees.size() + stride - 1) / (2 * stride);
+        pool.parallel_for(pairs, [&](size_t pair, size_t)
+                          { trees[2 * stride * pair]->merge(std::move(*trees[2 * stride * pair + stride])); });
+    }
+    trees.resize(std::min<size_t>(trees.size(), 1));
+}
+
+void Octray::finish_update()
+{
+    constexpr size_t block_bytes = 8 * sizeof(OctrayNode);
+    const size_t in_use = arena.block_count();
+    const size_t target = memory_budget / 4 * 3 / block_bytes;
+    if (memory_budget && in_use * block_bytes > memory_budget)
+    {
+        // Each inner node's block of children goes with it, so collapsing every node at least
+        // some age old frees the blocks counted at that age and above
+        blocks_by_age.assign(size_t{1} << 16, 0);
+        count_block_ages(this, blocks_by_age);
+        size_t threshold = blocks_by_age.size();
+        size_t freed = 0;
+        while (threshold > 1 && freed < in_use - target)
+            freed += blocks_by_age[--threshold];
+
+        std::vector<std::pair<OctreeKey, size_t>> stale;
+        if (freed)
+            find_stale(this, OctreeKey{}, 0, static_cast<uint16_t>(threshold), stale);
+        for (const auto &[key, depth] : stale)
+        {
+            OctrayNode *node = this;
+            for (size_t d = depth; d > 0; d--)
+            {
+                node->changed = true;
+                node = create_child(node, key.ancestor(static_cast<int>(d - 1)).child_index(), arena);
+            }
+            release_subtree(node);
+            node->clear_children();
+            node->changed = true;
+            OCTRAY_COUNT(SUBTREES_COLLAPSED, 1);
+        }
+        if (!stale.empty())
+            arena.trim();
+    }
+
+    // Checked every AGE_LIMIT / 2 epochs, no age gets past 3/4 of the epoch range
+    if (++epoch % (AGE_LIMIT / 2) == 0)
+        saturate_ages(this);
+}
 
-    while (!stack.empty())
+void Octray::count_block_ages(const OctrayNode *node, std::vector<size_t> &counts) const
+{
+    if (node->is_leaf())
+        return;
+    counts[age(node)]++;
+    for (int c = 0; c < 8; ++c)
     {
-        OctrayNode *current = stack.back();
-        stack.pop_back();
+        if (node->has_child(c))
+            count_block_ages(node->child(c), counts);
+    }
+}
 
-        int intersection = current->intersects(ray_start, ray_end);
-        if (!intersection)
+void Octray::find_stale(const OctrayNode *node, const OctreeKey &key, const size_t depth, const uint16_t threshold,
+                        std::vector<std::pair<OctreeKey, size_t>> &stale) const
+{
+    if (node->is_leaf())
+        return;
+    // Parents are updated with their children, so no node is older than its descendants
+    if (age(node) >= threshold)
+    {
+        stale.emplace_back(key, depth);
+        return;
+    }
+    for (int c = 0; c < 8; ++c)
+    {
+        if (node->has_child(c))
+            find_stale(node->child(c), key.child(c), depth + 1, threshold, stale);
+    }
+}
+
+void Octray::saturate_ages(OctrayNode *node)
+{
+    if (node->is_leaf())
+        return;
+    // Snapshots never read the epoch, so it is rewritten even in blocks they share
+    if (age(node) > AGE_LIMIT)
+        node->touched = static_cast<uint16_t>(epoch - AGE_LIMIT);
+    for (int c = 0; c < 8; ++c)
+    {
+        if (node->has_child(c))
+            saturate_ages(node->child(c));
+    }
+}
+
+void Octray::check_same_bounds(const Octray &other) const
+{
+    if (other.size != size || other.max_depth != max_depth || other.center.x != center.x || other.center.y != center.y || other.center.z != center.z)
+        throw std::invalid_argument("Octray merge needs trees of the same bounds and max depth");
+}
+
+void Octray::merge_subtree(OctrayNode *node, const OctrayNode *other, const bool owned, const bool mark_linked)
+{
+    // Nothing observed here yet, so other's subtree is taken as it is
+    if (node->is_leaf() && node->log_odds == 0.0f)
+    {
+        if (!owned)
         {
-            glm::mat4 transform = glm::mat4{1.0f};
-            transform = glm::translate(transform, glm::vec3{current->center.x, current->center.y, current->center.z});
-            transform = glm::scale(transform, glm::vec3{std::pow(0.5f, current->depth)});
+            copy_subtree(node, other);
+            return;
+        }
+        *node = *other;
+        if (mark_linked)
+            mark_changed(node);
+        node->changed = true;
+        return;
+    }
 
-            outlinedInstances.push_back({transform, {1.f, 1.f, 1.f}});
+    if (other->is_leaf())
+    {
+        // Other's root if it never saw a ray, which adds nothing
+        if (other->log_odds != 0.0f)
+            merge_uniform(node, other->log_odds);
+        return;
+    }
+
+    for (int c = 0; c < 8; ++c)
+    {
+        if (other->has_child(c))
+            merge_subtree(create_child(node, c, arena), other->child(c), owned, mark_linked);
+    }
+    // Each of its nodes has been merged or linked in by value
+    if (owned)
+        arena.free_block(other->children);
+    update_inner(node, arena);
+}
+
+void Octray::merge_uniform(OctrayNode *node, const float log_odds)
+{
+    if (node->is_leaf())
+    {
+        const float merged = std::clamp(node->log_odds + log_odds, occupancy.clamp_min, occupancy.clamp_max);
+        node->changed |= merged != node->log_odds;
+        node->log_odds = merged;
+        return;
+    }
+    for (int c = 0; c < 8; ++c)
+        merge_uniform(create_child(node, c, arena), log_odds);
+    update_inner(node, arena);
+}
+
+void Octray::copy_subtree(OctrayNode *node, const OctrayNode *other)
+{
+    node->log_odds = other->log_odds;
+    node->changed = true;
+    if (other->is_leaf())
+        return;
+
+    OctrayNode *block = arena.allocate_block();
+    for (int c = 0; c < 8; ++c)
+    {
+        if (!other->has_child(c))
             continue;
+        new (block + c) OctrayNode();
+        copy_subtree(block + c, other->child(c));
+    }
+    node->children = block;
+    node->child_mask = other->child_mask;
+}
+
+void Octray::mark_changed(OctrayNode *node)
+{
+    node->changed = true;
+    for (int c = 0; c < 8; ++c)
+    {
+        if (node->has_child(c))
+            mark_changed(node->child(c));
+    }
+}
+
+bool Octray::cast_ray(const Vec3f &origin, const Vec3f &direction, const float max_range, RayHit &hit, const size_t query_depth) const
+{
+    return cast_ray(this, occupancy, origin, direction, max_range, hit, query_depth);
+}
+
+bool Octray::cast_ray(const OctrayNode *root, const OccupancyParams &params, const Vec3f &origin, const Vec3f &direction, const float max_range, RayHit &hit,
+                      const size_t query_depth) const
+{
+    float length = direction.magnitude();
+    if (!root || !(length > 0.0f && max_range > 0.0f))
+        return false;
+
+    TraversalRay ray;
+    float t0[3], t1[3];
+    if (!setup_ray(origin, origin + direction * (max_range / length), ray, t0, t1))
+        return false;
+    if (!cast_subtree(root, OctreeKey{}, 0, std::min(query_depth, max_depth), t0, t1, ray, params, hit))
+        return false;
+
+    // The segment was scaled to t in [0, 1]
+    hit.distance *= max_range;
+    return true;
+}
+
+bool Octray::cast_subtree(const OctrayNode *node, const OctreeKey &key, const size_t depth, const size_t stop_depth, const float t0[3], const float t1[3],
+                          const TraversalRay &ray, const OccupancyParams &params, RayHit &hit) const
+{
+    // Inner nodes carry the max of their leaves, so this skips free subtrees whole
+    OCTRAY_COUNT(NODES_VISITED, 1);
+    OCTRAY_MAX(MAX_TRAVERSAL_DEPTH, depth);
+    if (!(node->log_odds > params.occupied_threshold))
+        return false;
+
+    if (depth >= stop_depth || node->is_leaf())
+    {
+        // Only a never observed root is a leaf above max depth without being pruned
+        if (depth < max_depth && node->is_leaf() && !is_pruned(node))
+            return false;
+        hit = {key, depth, std::max(0.0f, std::max(std::max(t0[0], t0[1]), t0[2]))};
+        return true;
+    }
+
+    bool found = false;
+    for_each_child_on_ray(key, depth, t0, t1, ray, [&](int child, const float c0[3], const float c1[3])
+                          {
+        found = node->has_child(child) && cast_subtree(node->child(child), key.child(child), depth + 1, stop_depth, c0, c1, ray, params, hit);
+        return found; });
+    return found;
+}
+
+template <typename Collect>
+void Octray::collect_subtrees(const OctreeKey &key, const size_t depth, const size_t stop_depth, const float t0[3], const float t1[3], const TraversalRay &ray, Collect &&collect) const
+{
+    if (depth >= stop_depth)
+    {
+        collect(key);
+        return;
+    }
+    for_each_child_on_ray(key, depth, t0, t1, ray, [&](int child, const float c0[3], const float c1[3])
+                          { collect_subtrees(key.child(child), depth + 1, stop_depth, c0, c1, ray, collect); });
+}
+
+void Octray::cells_on_segment(const Vec3f &start, const Vec3f &end, const size_t depth, std::vector<OctreeKey> &keys) const
+{
+    keys.clear();
+    TraversalRay ray;
+    float t0[3], t1[3];
+    if (!setup_ray(start, end, ray, t0, t1))
+        return;
+    collect_subtrees(OctreeKey{}, 0, std::min(depth, max_depth), t0, t1, ray, [&](const OctreeKey &key)
+                     { keys.push_back(key); });
+}
+
+void Octray::update_leaf(OctrayNode *leaf, const int intersection) const
+{
+    float delta = intersection == END_POINT_INSIDE ? occupancy.hit : occupancy.miss;
+    float updated = std::clamp(leaf->log_odds + delta, occupancy.clamp_min, occupancy.clamp_max);
+    OCTRAY_COUNT(LEAF_UPDATES, 1);
+    leaf->changed |= updated != leaf->log_odds;
+    leaf->log_odds = updated;
+}
+
+void Octray::update_inner(OctrayNode *node, NodeArena<OctrayNode> &node_arena) const
+{
+    if (node->is_leaf())
+        return;
+    node->touched = epoch;
+
+    float max_log_odds = -infinity;
+    bool changed = false;
+    if (node->child_mask != 0xFF)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            if (node->has_child(i))
+            {
+                max_log_odds = std::max(max_log_odds, node->child(i)->log_odds);
+                changed |= node->child(i)->changed;
+            }
         }
+        node->log_odds = max_log_odds;
+        node->changed |= changed;
+        return;
+    }
 
-        if (current->leaf)
+    // Only a full set of children can be collapsed
+    const OctrayNode *children = node->child(0);
+    const float first = children[0].log_odds;
+    bool uniform = true;
+    for (int i = 0; i < 8; ++i)
+    {
+        max_log_odds = std::max(max_log_odds, children[i].log_odds);
+        uniform &= children[i].is_leaf() & (children[i].log_odds == first);
+        changed |= children[i].changed;
+    }
+    node->log_odds = max_log_odds;
+    node->changed |= changed;
+
+    if (uniform && (max_log_odds == occupancy.clamp_min || max_log_odds == occupancy.clamp_max))
+    {
+        // Blocks allocated by another arena, e.g. a worker's, simply join this one's free list
+        release_block(node->children, node_arena);
+        node->clear_children();
+        node->changed = true;
+        OCTRAY_COUNT(PRUNES, 1);
+    }
+}
+
+void Octray::update_inner_nodes(OctrayNode *node, const size_t depth, const size_t stop_depth)
+{
+    // Children still shared with a published version were not touched by this batch
+    if (depth >= stop_depth || node->is_leaf() || NodeArena<OctrayNode>::block_tag(node->children) != write_version)
+        return;
+    for (int i = 0; i < 8; ++i)
+    {
+        if (node->has_child(i))
+            update_inner_nodes(node->child(i), depth + 1, stop_depth);
+    }
+    update_inner(node, arena);
+}
+
+const OctrayNode *Octray::search(const Vec3f &point, const size_t query_depth) const
+{
+    return search(this, point, query_depth);
+}
+
+const OctrayNode *Octray::search(const OctrayNode *root, const Vec3f &point, const size_t query_depth) const
+{
+    // A never observed root is the only leaf above max depth that is not pruned
+    const size_t stop_depth = std::min(query_depth, max_depth);
+    OctreeKey key;
+    if (!root || (root->is_leaf() && max_depth > 0 && !is_pruned(root)) || !key_at(point, stop_depth, key))
+        return nullptr;
+
+    const OctrayNode *node = root;
+    for (size_t depth = 0; depth < stop_depth; ++depth)
+    {
+        if (node->is_leaf())
+            return is_pruned(node) ? node : nullptr;
+        int child = key.ancestor(static_cast<int>(stop_depth - depth - 1)).child_index();
+        if (!node->has_child(child))
+            return nullptr;
+        node = node->child(child);
+    }
+    return node;
+}
+
+void Octray::query_points(const Vec3f *points, const size_t count, const OctrayNode **results, const size_t query_depth) const
+{
+    query_points(this, points, count, results, query_depth);
+}
+
+void Octray::query_points(const OctrayNode *root, const Vec3f *points, const size_t count, const OctrayNode **results, const size_t query_depth) const
+{
+    OCTRAY_TIME_SCOPE(TIME_QUERY_POINTS);
+    // A never observed root is the only leaf above max depth that is not pruned
+    if (!root || (root->is_leaf() && max_depth > 0 && !is_pruned(root)))
+    {
+        std::fill(results, results + count, nullptr);
+        return;
+    }
+
+    // Codes are of cells at the query depth, so coarse queries also sort fewer bits
+    const size_t stop_depth = std::min(query_depth, max_depth);
+    const float cells = static_cast<float>(uint64_t{1} << stop_depth);
+    const float scale = cells / size;
+    const uint32_t last = static_cast<uint32_t>((uint64_t{1} << stop_depth) - 1);
+
+    // Fills sorted with make(code, i) for the points inside the octree. Keys are found without
+    // branching on whether a point is inside, as most batches mix both.
+    auto find_codes = [&](auto &sorted, auto &&make)
+    {
+        sorted.resize(count);
+        size_t inside = 0;
+        for (size_t i = 0; i < count; i++)
         {
-            if (current->depth >= max_depth)
+            const float cell[3] = {(points[i].x - min_corner.x) * scale, (points[i].y - min_corner.y) * scale, (points[i].z - min_corner.z) * scale};
+            bool in_bounds = true;
+            uint32_t k[3];
+            for (int axis = 0; axis < 3; ++axis)
             {
-                glm::mat4 transform = glm::mat4{1.0f};
-                transform = glm::translate(transform, glm::vec3{current->center.x, current->center.y, current->center.z});
-                transform = glm::scale(transform, glm::vec3{std::pow(0.5f, current->depth)});
-                if (intersection == PASSES_THROUGH)
+                in_bounds &= (cell[axis] >= 0.0f) & (cell[axis] <= cells);
+                k[axis] = std::min(static_cast<uint32_t>(std::max(cell[axis], 0.0f)), last);
+            }
+            sorted[inside] = make(OctreeKey{k[0], k[1], k[2]}.morton_code(), i);
+            inside += in_bounds;
+            results[i] = nullptr;
+        }
+        sorted.resize(inside);
+    };
+
+    // Looks up the sorted points, each one descending only from where its path leaves the
+    // previous one's
+    auto walk = [&](const auto &sorted, auto &&code_of, auto &&index_of)
+    {
+        // path[d] is the node at depth d of the previous lookup, valid down to path_depth
+        const OctrayNode *path[MAX_DEPTH_LIMIT + 1];
+        path[0] = root;
+        size_t path_depth = 0;
+        uint64_t previous = 0;
+        for (const auto &item : sorted)
+        {
+            const uint64_t code = code_of(item);
+
+            // Codes agree on every child index above the highest differing bit, and so do their paths
+            size_t depth = path_depth;
+            const uint64_t diff = code ^ previous;
+            for (size_t bit = 3 * stop_depth; diff && bit > 0; bit -= 3)
+            {
+                if (diff >> (bit - 3))
                 {
-                    filledInstances.push_back({transform, {0.f, 1.f, 0.f}});
+                    depth = std::min(depth, stop_depth - bit / 3);
+                    break;
                 }
-                else if (intersection == END_POINT_INSIDE)
+            }
+            previous = code;
+
+            const OctrayNode *node = path[depth];
+            const OctrayNode *result = node;
+            for (; depth < stop_depth; ++depth)
+            {
+                if (node->is_leaf())
                 {
-                    filledInstances.push_back({transform, {1.f, 0.f, 0.f}});
+                    result = is_pruned(node) ? node : nullptr;
+                    break;
                 }
-                continue;
+                int child = static_cast<int>((code >> (3 * (stop_depth - depth - 1))) & 7);
+                if (!node->has_child(child))
+                {
+                    result = nullptr;
+                    break;
+                }
+                node = node->child(child);
+                path[depth + 1] = node;
+                result = node;
             }
-            current->split();
+            path_depth = depth;
+            results[index_of(item)] = result;
         }
-        for (OctrayNode *child : current->children)
+    };
+
+    const int code_bits = 3 * static_cast<int>(stop_depth);
+    int index_bits = 0;
+    while (index_bits < 64 && (uint64_t{1} << index_bits) < count)
+        index_bits++;
+
+    if (code_bits + index_bits <= 64 && index_bits < 64)
+    {
+        // Code and index packed in one word, which halves the memory the sort moves
+        const uint64_t index_mask = (uint64_t{1} << index_bits) - 1;
+        std::vector<uint64_t> sorted;
+        find_codes(sorted, [&](uint64_t code, size_t i)
+                   { return code << index_bits | i; });
+        radix_sort(sorted, index_bits, code_bits, [](uint64_t item)
+                   { return item; });
+        walk(sorted, [&](uint64_t item)
+             { return item >> index_bits; }, [&](uint64_t item)
+             { return static_cast<size_t>(item & index_mask); });
+    }
+    else
+    {
+        std::vector<CodedPoint> sorted;
+        find_codes(sorted, [](uint64_t code, size_t i)
+                   { return CodedPoint{code, i}; });
+        radix_sort(sorted, 0, code_bits, [](const CodedPoint &item)
+                   { return item.code; });
+        walk(sorted, [](const CodedPoint &item)
+             { return item.code; }, [](const CodedPoint &item)
+             { return item.index; });
+    }
+}
+
+void Octray::clear()
+{
+    if (published_root.load())
+        release_subtree(this);
+    else
+        arena.reset();
+    clear_children();
+    log_odds = 0.0f;
+    changed = true;
+}
+
+void Octray::release_block(OctrayNode *block, NodeArena<OctrayNode> &node_arena) const
+{
+    if (NodeArena<OctrayNode>::block_tag(block) == write_version)
+        node_arena.free_block(block);
+    else
+        node_arena.defer_free(block, write_version);
+}
+
+void Octray::release_subtree(OctrayNode *node)
+{
+    if (node->is_leaf())
+        return;
+    for (int i = 0; i < 8; ++i)
+    {
+        if (node->has_child(i))
+            release_subtree(node->child(i));
+    }
+    release_block(node->children, arena);
+}
+
+void Octray::publish()
+{
+    OCTRAY_TIME_SCOPE(TIME_PUBLISH);
+    // The working root is the one node the writer keeps changing in place, readers get a copy
+    OctrayNode *root = arena.allocate_block();
+    new (root) OctrayNode(static_cast<const OctrayNode &>(*this));
+
+    if (occupancy_changed)
+    {
+        occupancy_versions.back().second = write_version;
+        occupancy_versions.emplace_back(std::make_unique<const OccupancyParams>(occupancy), FREE_SLOT);
+        occupancy_changed = false;
+    }
+
+    publish_sequence.fetch_add(1);
+    const OctrayNode *previous = published_root.exchange(root);
+    published_occupancy.store(occupancy_versions.back().first.get());
+    published_version.store(write_version);
+    publish_sequence.fetch_add(1);
+    if (previous)
+        arena.defer_free(const_cast<OctrayNode *>(previous), write_version);
+
+    // Every block allocated so far now belongs to a published version
+    write_version++;
+    arena.set_tag(write_version);
+
+    // Blocks retired while building version v are unreachable from v on
+    uint64_t oldest = published_version.load();
+    for (size_t i = 0; i < MAX_SNAPSHOTS; i++)
+        oldest = std::min(oldest, reader_slots[i].version.load());
+    const size_t deferred = arena.deferred_count();
+    arena.release_deferred(oldest);
+    occupancy_versions.erase(std::remove_if(occupancy_versions.begin(), occupancy_versions.end() - 1, [&](const auto &entry)
+                                            { return entry.second <= oldest; }),
+                             occupancy_versions.end() - 1);
+    // Collapsed subtrees a snapshot could still reach are only freed here
+    if (memory_budget && arena.deferred_count() < deferred)
+        arena.trim();
+}
+
+Octray::Snapshot Octray::snapshot() const
+{
+    while (true)
+    {
+        const uint64_t sequence = publish_sequence.load();
+        if (sequence & 1)
+            continue;
+
+        // Pin before looking at the root, so a publish racing with this cannot free it unseen
+        const uint64_t version = published_version.load();
+        std::atomic<uint64_t> *slot = nullptr;
+        for (size_t i = 0; i < MAX_SNAPSHOTS && !slot; i++)
         {
-            if (child)
-            {
-                stack.push_back(child);
-            }
+            uint64_t expected = FREE_SLOT;
+            if (reader_slots[i].version.compare_exchange_strong(expected, version))
+                slot = &reader_slots[i].version;
         }
+        if (!slot)
+            throw std::runtime_error("Octray::snapshot: MAX_SNAPSHOTS snapshots are already held");
+
+        const OctrayNode *root = published_root.load();
+        const OccupancyParams *params = published_occupancy.load();
+        if (publish_sequence.load() == sequence)
+            return Snapshot(this, root, *params, slot, version);
+        slot->store(FREE_SLOT);
     }
+}
+
+Octray::Snapshot::Snapshot(Snapshot &&other) noexcept
+    : octray(other.octray), root(other.root), occupancy(other.occupancy), slot(other.slot), pinned_version(other.pinned_version)
+{
+    other.slot = nullptr;
+}
+
+Octray::Snapshot &Octray::Snapshot::operator=(Snapshot &&other) noexcept
+{
+    if (&other == this)
+        return *this;
+    if (slot)
+        slot->store(FREE_SLOT);
+    octray = other.octray;
+    root = other.root;
+    occupancy = other.occupancy;
+    slot = other.slot;
+    pinned_version = other.pinned_version;
+    other.slot = nullptr;
+    return *this;
+}
+
+Octray::Snapshot::~Snapshot()
+{
+    if (slot)
+        slot->store(FREE_SLOT);
 }
\ No newline at end of file
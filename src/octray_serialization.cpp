@@ -0,0 +1,200 @@
+#include "octray_file_format.hpp"
+#include "octray_node.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    constexpr size_t IO_BUFFER_BYTES = 1 << 16;
+
+    // Batches the small node records into large stream writes
+    class RecordWriter
+    {
+    public:
+        explicit RecordWriter(std::ostream &_out) : out(_out) { buffer.reserve(IO_BUFFER_BYTES); }
+
+        void put(const void *data, const size_t bytes)
+        {
+            if (buffer.size() + bytes > IO_BUFFER_BYTES)
+                flush();
+            const unsigned char *begin = static_cast<const unsigned char *>(data);
+            buffer.insert(buffer.end(), begin, begin + bytes);
+        }
+
+        void flush()
+        {
+            out.write(reinterpret_cast<const char *>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+            buffer.clear();
+            if (!out)
+                throw std::runtime_error("Octray::write failed to write the stream");
+        }
+
+    private:
+        std::ostream &out;
+        std::vector<unsigned char> buffer;
+    };
+
+    // Reads exactly stream_bytes of node records, in large stream reads
+    class RecordReader
+    {
+    public:
+        RecordReader(std::istream &_in, const uint64_t _stream_bytes) : in(_in), remaining(_stream_bytes) {}
+
+        void get(void *data, const size_t bytes)
+        {
+            if (bytes > remaining)
+                throw std::runtime_error("Octray::read: node records overrun the stream size");
+            if (position + bytes > buffer.size())
+                refill();
+            std::memcpy(data, buffer.data() + position, bytes);
+            position += bytes;
+            remaining -= bytes;
+        }
+
+        bool finished() const { return remaining == 0; }
+
+    private:
+        void refill()
+        {
+            buffer.erase(buffer.begin(), buffer.begin() + static_cast<std::ptrdiff_t>(position));
+            position = 0;
+            size_t wanted = static_cast<size_t>(std::min<uint64_t>(IO_BUFFER_BYTES, remaining)) - buffer.size();
+            size_t old_size = buffer.size();
+            buffer.resize(old_size + wanted);
+            in.read(reinterpret_cast<char *>(buffer.data() + old_size), static_cast<std::streamsize>(wanted));
+            if (!in)
+                throw std::runtime_error("Octray::read: stream ended early");
+        }
+
+        std::istream &in;
+        uint64_t remaining;
+        std::vector<unsigned char> buffer;
+        size_t position = 0;
+    };
+}
+
+void Octray::write(std::ostream &out) const
+{
+    // Every inner node's record carries the size of its subtree, so sizes are found first,
+    // in the same depth first order the records are written in
+    std::vector<uint64_t> subtree_bytes;
+    uint64_t node_count = 0;
+    auto measure = [&](auto &self, const OctrayNode *node) -> uint64_t
+    {
+        node_count++;
+        if (node->is_leaf())
+            return OctrayFileHeader::LEAF_RECORD_BYTES;
+
+        size_t slot = subtree_bytes.size();
+        subtree_bytes.push_back(0);
+        uint64_t below = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            if (node->has_child(i))
+                below += self(self, node->child(i));
+        }
+        subtree_bytes[slot] = below;
+        return OctrayFileHeader::INNER_RECORD_BYTES + below;
+    };
+    uint64_t stream_bytes = measure(measure, this);
+
+    OctrayFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, OctrayFileHeader::MAGIC, sizeof(header.magic));
+    header.version = OctrayFileHeader::VERSION;
+    header.byte_order = OctrayFileHeader::ENDIAN_TAG;
+    header.max_depth = static_cast<uint32_t>(max_depth);
+    header.center[0] = center.x;
+    header.center[1] = center.y;
+    header.center[2] = center.z;
+    header.size = size;
+    header.hit = occupancy.hit;
+    header.miss = occupancy.miss;
+    header.clamp_min = occupancy.clamp_min;
+    header.clamp_max = occupancy.clamp_max;
+    header.occupied_threshold = occupancy.occupied_threshold;
+    header.node_count = node_count;
+    header.stream_bytes = stream_bytes;
+
+    RecordWriter writer(out);
+    writer.put(&header, sizeof(header));
+
+    size_t next_inner = 0;
+    auto emit = [&](auto &self, const OctrayNode *node) -> void
+    {
+        writer.put(&node->child_mask, sizeof(uint8_t));
+        writer.put(&node->log_odds, sizeof(float));
+        if (node->is_leaf())
+            return;
+
+        writer.put(&subtree_bytes[next_inner++], sizeof(uint64_t));
+        for (int i = 0; i < 8; ++i)
+        {
+            if (node->has_child(i))
+                self(self, node->child(i));
+        }
+    };
+    emit(emit, this);
+    writer.flush();
+}
+
+void Octray::write(const std::string &path) const
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw std::runtime_error("Octray::write could not open " + path);
+    write(out);
+}
+
+std::unique_ptr<Octray> Octray::read(std::istream &in)
+{
+    OctrayFileHeader header;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in)
+        throw std::runtime_error("Octray::read: octray file is truncated");
+    // The stream's length is unknown up front; running out of records is caught while reading
+    if (const char *error = header.validate(sizeof(header) + header.stream_bytes, MAX_DEPTH_LIMIT))
+        throw std::runtime_error(std::string("Octray::read: ") + error);
+
+    std::unique_ptr<Octray> octray = std::make_unique<Octray>(Vec3f{header.center[0], header.center[1], header.center[2]}, header.size, header.max_depth);
+    octray->set_occupancy_params({header.hit, header.miss, header.clamp_min, header.clamp_max, header.occupied_threshold});
+
+    RecordReader reader(in, header.stream_bytes);
+    auto load = [&](auto &self, OctrayNode *node, const size_t depth) -> void
+    {
+        uint8_t mask;
+        reader.get(&mask, sizeof(mask));
+        reader.get(&node->log_odds, sizeof(float));
+        if (!mask)
+            return;
+        if (depth >= octray->max_depth)
+            throw std::runtime_error("Octray::read: node below max_depth");
+
+        uint64_t subtree_bytes;
+        reader.get(&subtree_bytes, sizeof(subtree_bytes));
+        for (int i = 0; i < 8; ++i)
+        {
+            if (mask & (1 << i))
+                self(self, node->get_or_create_child(i, octray->arena), depth + 1);
+        }
+    };
+    load(load, octray.get(), 0);
+
+    if (!reader.finished())
+        throw std::runtime_error("Octray::read: trailing bytes after the node records");
+    return octray;
+}
+
+std::unique_ptr<Octray> Octray::read(const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("Octray::read could not open " + path);
+    return read(in);
+}
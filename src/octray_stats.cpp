@@ -0,0 +1,170 @@
+#include "octray_stats.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+namespace
+{
+    const char *const COUNTER_NAMES[OctrayStats::COUNTER_COUNT] = {
+        "nodes_visited",
+        "child_interval_tests",
+        "leaf_updates",
+        "nodes_split",
+        "pruned_expanded",
+        "prunes",
+        "blocks_copied",
+        "blocks_allocated",
+        "blocks_freed",
+        "instances_written",
+        "subtrees_collapsed",
+    };
+    const char *const GAUGE_NAMES[OctrayStats::GAUGE_COUNT] = {"bytes_in_use", "bytes_reserved"};
+    const char *const MAXIMUM_NAMES[OctrayStats::MAXIMUM_COUNT] = {"max_traversal_depth"};
+    const char *const TIMER_NAMES[OctrayStats::TIMER_COUNT] = {
+        "accumulate_rays",
+        "insert_scan",
+        "query_points",
+        "publish",
+        "instance_update",
+    };
+
+    void add(OctrayStats::Totals &totals, const OctrayStats::ThreadSlots &slots)
+    {
+        for (int i = 0; i < OctrayStats::COUNTER_COUNT; ++i)
+            totals.counters[i] += slots.counters[i].load(std::memory_order_relaxed);
+        for (int i = 0; i < OctrayStats::GAUGE_COUNT; ++i)
+            totals.gauges[i] += static_cast<int64_t>(slots.gauges[i].load(std::memory_order_relaxed));
+        for (int i = 0; i < OctrayStats::MAXIMUM_COUNT; ++i)
+            totals.maximums[i] = std::max(totals.maximums[i], slots.maximums[i].load(std::memory_order_relaxed));
+        for (int i = 0; i < OctrayStats::TIMER_COUNT; ++i)
+        {
+            totals.timer_nanoseconds[i] += slots.timer_nanoseconds[i].load(std::memory_order_relaxed);
+            totals.timer_calls[i] += slots.timer_calls[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    struct Registry
+    {
+        std::mutex mutex;
+        std::vector<OctrayStats::ThreadSlots *> live;
+        OctrayStats::Totals retired;  // counts of exited threads
+        OctrayStats::Totals baseline; // counts at the last reset
+
+        // Everything counted since the process started
+        OctrayStats::Totals raw()
+        {
+            OctrayStats::Totals totals = retired;
+            for (const OctrayStats::ThreadSlots *slots : live)
+                add(totals, *slots);
+            return totals;
+        }
+    };
+
+    // Never destroyed, as threads may still exit after static destructors have run
+    Registry &registry()
+    {
+        static Registry *instance = new Registry;
+        return *instance;
+    }
+
+    struct ThreadRegistration
+    {
+        OctrayStats::ThreadSlots slots;
+
+        ThreadRegistration()
+        {
+            Registry &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            r.live.push_back(&slots);
+        }
+
+        ~ThreadRegistration()
+        {
+            Registry &r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            add(r.retired, slots);
+            r.live.erase(std::find(r.live.begin(), r.live.end(), &slots));
+        }
+    };
+}
+
+OctrayStats::ThreadSlots &OctrayStats::register_thread()
+{
+    thread_local ThreadRegistration registration;
+    return registration.slots;
+}
+
+OctrayStats::Totals OctrayStats::collect()
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    Totals totals = r.raw();
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        totals.counters[i] -= r.baseline.counters[i];
+    for (int i = 0; i < TIMER_COUNT; ++i)
+    {
+        totals.timer_nanoseconds[i] -= r.baseline.timer_nanoseconds[i];
+        totals.timer_calls[i] -= r.baseline.timer_calls[i];
+    }
+    return totals;
+}
+
+void OctrayStats::reset()
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.baseline = r.raw();
+
+    // A thread raising its maximum meanwhile may keep its old value, which is harmless
+    for (int i = 0; i < MAXIMUM_COUNT; ++i)
+    {
+        r.retired.maximums[i] = 0;
+        for (ThreadSlots *slots : r.live)
+            slots->maximums[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void OctrayStats::write_json(std::ostream &out, const Totals &totals)
+{
+    out << "{";
+    const char *separator = "";
+    auto field = [&](const char *name, const char *suffix, auto value)
+    {
+        out << separator << "\"" << name << suffix << "\": " << value;
+        separator = ", ";
+    };
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        field(COUNTER_NAMES[i], "", totals.counters[i]);
+    for (int i = 0; i < GAUGE_COUNT; ++i)
+        field(GAUGE_NAMES[i], "", totals.gauges[i]);
+    for (int i = 0; i < MAXIMUM_COUNT; ++i)
+        field(MAXIMUM_NAMES[i], "", totals.maximums[i]);
+    for (int i = 0; i < TIMER_COUNT; ++i)
+    {
+        field(TIMER_NAMES[i], "_seconds", static_cast<double>(totals.timer_nanoseconds[i]) * 1e-9);
+        field(TIMER_NAMES[i], "_calls", totals.timer_calls[i]);
+    }
+    out << "}";
+}
+
+void OctrayStats::write_prometheus(std::ostream &out, const Totals &totals)
+{
+    auto metric = [&](const char *name, const char *suffix, const char *type, auto value)
+    {
+        out << "# TYPE octray_" << name << suffix << " " << type << "\n"
+            << "octray_" << name << suffix << " " << value << "\n";
+    };
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        metric(COUNTER_NAMES[i], "_total", "counter", totals.counters[i]);
+    for (int i = 0; i < GAUGE_COUNT; ++i)
+        metric(GAUGE_NAMES[i], "", "gauge", totals.gauges[i]);
+    for (int i = 0; i < MAXIMUM_COUNT; ++i)
+        metric(MAXIMUM_NAMES[i], "", "gauge", totals.maximums[i]);
+    for (int i = 0; i < TIMER_COUNT; ++i)
+    {
+        metric(TIMER_NAMES[i], "_seconds_total", "counter", static_cast<double>(totals.timer_nanoseconds[i]) * 1e-9);
+        metric(TIMER_NAMES[i], "_calls_total", "counter", totals.timer_calls[i]);
+    }
+}
@@ -1,4 +1,5 @@
 #include "octray_node.hpp"
+#include "cube_instance_visitor.hpp"
 #include "visualization_util.hpp"
 
 #include <glad/glad.h>
@@ -16,6 +17,8 @@
 #include <sstream>
 #include <string>
 #include <chrono>
+#include <limits>
+#include <vector>
 
 #define WIDTH 1280
 #define HEIGHT 720
@@ -33,6 +36,7 @@ glm::vec3 focal_point{0.f, 0.f, 0.f};
 void mouse_callback(GLFWwindow *window, double xpos, double ypos);
 void scroll_callback(GLFWwindow *window, double xpos, double ypos);
 glm::vec3 getCameraPosition();
+void scanRoom(const Vec3f &origin, std::vector<Vec3f> &points);
 
 int main()
 {
@@ -65,8 +69,10 @@ int main()
     {
         using namespace std::chrono;
 
+        CubeInstanceVisitor visitor(octray, solidInstances, outlineInstances);
+
         time_point start_time = high_resolution_clock::now();
-        octray.accumulate_ray(ray_start, ray_end, solidInstances, outlineInstances);
+        octray.accumulate_ray(ray_start, ray_end, visitor);
         time_point end_time = high_resolution_clock::now();
 
         auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time);
@@ -80,6 +86,32 @@ int main()
 
     generate_buffers(&VBO_solid, &VBO_outline, &VAO_solid, &VAO_outline, &instanceVBO_solid, &instanceVBO_outline, solidInstances, outlineInstances);
 
+    // Occupied nodes of the map, kept in a persistent buffer patched with each frame's changes
+    InstanceSlots<CubeInstance> mapSlots({{0.f, 0.f, 0.f}, 0, CUBE_HIDDEN, {0, 0}});
+    auto makeMapInstance = [&](const OctrayNode &node, const OctreeKey &key, const size_t depth, CubeInstance &instance)
+    {
+        if (!octray.is_occupied(node))
+            return false;
+        instance = make_cube_instance(octray, key, depth, CUBE_ORANGE);
+        return true;
+    };
+
+    GLuint VAO_map, instanceVBO_map;
+    size_t mapCapacity = 0;
+    generate_instance_buffers(VBO_solid, &VAO_map, &instanceVBO_map);
+
+    // Outlines of the tree's nodes in view, regenerated every frame down to minPixels on screen
+    std::vector<CubeInstance> viewInstances;
+    GLuint VAO_view, instanceVBO_view;
+    generate_instance_buffers(VBO_outline, &VAO_view, &instanceVBO_view);
+    bool showStructure = false;
+    float minPixels = 4.f;
+
+    bool liveScan = false;
+    float sensorAngle = 0.f;
+    size_t uploadedLastFrame = 0;
+    std::vector<Vec3f> scanPoints;
+
     GLuint shaderProgram = createShaderProgramFromFile("../shaders/cube_vertex_shader.glsl", "../shaders/cube_fragment_shader.glsl");
     if (shaderProgram == -1)
         return -1;
@@ -103,6 +135,16 @@ int main()
             yaw = -90.0f;
         }
 
+        if (liveScan)
+        {
+            sensorAngle += 0.01f;
+            Vec3f origin{0.25f * std::cos(sensorAngle), 0.f, 0.25f * std::sin(sensorAngle)};
+            scanRoom(origin, scanPoints);
+            octray.insert_scan(origin, scanPoints.data(), scanPoints.size());
+        }
+        mapSlots.update(octray, makeMapInstance);
+        uploadedLastFrame = upload_instances(instanceVBO_map, mapSlots, &mapCapacity);
+
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         glUseProgram(shaderProgram);
@@ -111,6 +153,15 @@ int main()
         glm::vec3 cameraUp(0.0f, 1.0f, 0.0f);
         glm::mat4 view = glm::lookAt(cameraPos, focal_point, cameraUp);
 
+        viewInstances.clear();
+        if (showStructure)
+        {
+            ViewFrustum frustum(glm::value_ptr(view), glm::value_ptr(projection), HEIGHT);
+            octray.query_view(frustum, minPixels, [&](const OctrayNode &, const OctreeKey &key, const size_t depth)
+                              { viewInstances.push_back(make_cube_instance(octray, key, depth, CUBE_WHITE)); });
+            stream_instances(instanceVBO_view, viewInstances);
+        }
+
         GLuint modelLoc = glGetUniformLocation(shaderProgram, "model");
         GLuint viewLoc = glGetUniformLocation(shaderProgram, "view");
         GLuint projectionLoc = glGetUniformLocation(shaderProgram, "projection");
@@ -118,6 +169,9 @@ int main()
         GLuint cameraPosLoc = glGetUniformLocation(shaderProgram, "cameraPos");
         glUniform3fv(cameraPosLoc, 1, glm::value_ptr(cameraPos));
 
+        GLuint rootSizeLoc = glGetUniformLocation(shaderProgram, "rootSize");
+        glUniform1f(rootSizeLoc, octray.node_size(0));
+
         glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
         glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
         glUniformMatrix4fv(projectionLoc, 1, GL_FALSE, glm::value_ptr(projection));
@@ -134,12 +188,32 @@ int main()
             glBindVertexArray(VAO_outline);
             glDrawArraysInstanced(GL_LINES, 0, 24, outlineInstances.size());
         }
+        if (mapSlots.slot_count() > 0)
+        {
+            glBindVertexArray(VAO_map);
+            glDrawArraysInstanced(GL_TRIANGLES, 0, 36, mapSlots.slot_count());
+        }
+        if (viewInstances.size() > 0)
+        {
+            glLineWidth(0.5f);
+            glBindVertexArray(VAO_view);
+            glDrawArraysInstanced(GL_LINES, 0, 24, viewInstances.size());
+        }
         // [------------------------]
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
 
+        ImGui::Begin("Map");
+        ImGui::Checkbox("Live scan", &liveScan);
+        ImGui::Text("%zu occupied cubes in %zu slots", mapSlots.drawn_count(), mapSlots.slot_count());
+        ImGui::Text("%zu instances uploaded this frame", uploadedLastFrame);
+        ImGui::Checkbox("Tree structure", &showStructure);
+        ImGui::SliderFloat("Min pixels", &minPixels, 1.f, 32.f);
+        ImGui::Text("%zu nodes in view", viewInstances.size());
+        ImGui::End();
+
         ImGui::Render();
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
 
@@ -149,8 +223,12 @@ int main()
     glDeleteBuffers(1, &VBO_outline);
     glDeleteBuffers(1, &instanceVBO_solid);
     glDeleteBuffers(1, &instanceVBO_outline);
+    glDeleteBuffers(1, &instanceVBO_map);
+    glDeleteBuffers(1, &instanceVBO_view);
     glDeleteVertexArrays(1, &VAO_solid);
     glDeleteVertexArrays(1, &VAO_outline);
+    glDeleteVertexArrays(1, &VAO_map);
+    glDeleteVertexArrays(1, &VAO_view);
 
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
@@ -169,6 +247,31 @@ glm::vec3 getCameraPosition()
     return focal_point + glm::vec3(x, y, z);
 }
 
+// Simulated sensor in a closed room: rays in random directions ending on its walls
+void scanRoom(const Vec3f &origin, std::vector<Vec3f> &points)
+{
+    const float wall = 0.45f;
+    points.clear();
+    for (int i = 0; i < 256; ++i)
+    {
+        Vec3f direction{
+            (float)(rand()) / RAND_MAX - 0.5f,
+            (float)(rand()) / RAND_MAX - 0.5f,
+            (float)(rand()) / RAND_MAX - 0.5f,
+        };
+        const float d[3] = {direction.x, direction.y, direction.z};
+        const float o[3] = {origin.x, origin.y, origin.z};
+        float t = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (d[axis] != 0.f)
+                t = std::min(t, ((d[axis] > 0.f ? wall : -wall) - o[axis]) / d[axis]);
+        }
+        if (t < std::numeric_limits<float>::infinity())
+            points.push_back(origin + direction * t);
+    }
+}
+
 void mouse_callback(GLFWwindow *window, double xpos, double ypos)
 {
     if (firstMouse)
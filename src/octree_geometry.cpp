@@ -0,0 +1,110 @@
+#include "octree_geometry.hpp"
+
+#include <algorithm>
+
+namespace
+{
+    constexpr float infinity = std::numeric_limits<float>::infinity();
+}
+
+OctreeGeometry::OctreeGeometry(const Vec3f &_center, const float _size, const size_t _max_depth)
+    : center(_center), size(_size), min_corner(_center - Vec3f{_size, _size, _size} * 0.5f), max_depth(_max_depth)
+{
+}
+
+Vec3f OctreeGeometry::node_center(const OctreeKey &key, const size_t depth) const
+{
+    float half_size = node_size(depth + 1);
+    return {min_corner.x + static_cast<float>(2 * key.x + 1) * half_size,
+            min_corner.y + static_cast<float>(2 * key.y + 1) * half_size,
+            min_corner.z + static_cast<float>(2 * key.z + 1) * half_size};
+}
+
+bool OctreeGeometry::key_at(const Vec3f &min_corner, const float size, const Vec3f &point, const size_t depth, OctreeKey &key)
+{
+    const float offset[3] = {point.x - min_corner.x, point.y - min_corner.y, point.z - min_corner.z};
+    const uint32_t last = (1u << depth) - 1;
+    const float cells = static_cast<float>(last + 1);
+
+    uint32_t k[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        float cell = offset[i] / size * cells;
+        if (!(cell >= 0.0f && cell <= cells))
+            return false;
+        // The max face belongs to the last cell
+        k[i] = std::min(static_cast<uint32_t>(cell), last);
+    }
+    key = {k[0], k[1], k[2]};
+    return true;
+}
+
+bool OctreeGeometry::setup_ray(const Vec3f &ray_start, const Vec3f &ray_end, TraversalRay &ray, float t0[3], float t1[3]) const
+{
+    const float start[3] = {ray_start.x, ray_start.y, ray_start.z};
+    const float dir[3] = {ray_end.x - ray_start.x, ray_end.y - ray_start.y, ray_end.z - ray_start.z};
+    const float root_center[3] = {center.x, center.y, center.z};
+    const float half_size = size * 0.5f;
+
+    // Mirror the ray so every direction component is non-negative (Revelles et al.),
+    // the flipped axes are remembered in ray.mirror and undone when indexing children.
+    // Parallel axes are left unmirrored, their origin is compared against the unmirrored mid-planes
+    ray.mirror = 0;
+
+    bool miss = false;
+    for (int i = 0; i < 3; ++i)
+    {
+        float origin = start[i];
+        float d = dir[i];
+        ray.parallel[i] = std::abs(d) < 1e-6f;
+        if (d < 0.0f && !ray.parallel[i])
+        {
+            origin = 2.0f * root_center[i] - origin;
+            d = -d;
+            ray.mirror |= 1 << i;
+        }
+        ray.origin[i] = origin;
+        ray.inv_dir[i] = ray.parallel[i] ? 0.0f : 1.0f / d;
+
+        float min = root_center[i] - half_size;
+        float max = root_center[i] + half_size;
+        if (ray.parallel[i])
+        {
+            miss |= origin < min || origin > max;
+            t0[i] = -infinity;
+            t1[i] = infinity;
+        }
+        else
+        {
+            t0[i] = (min - origin) * ray.inv_dir[i];
+            t1[i] = (max - origin) * ray.inv_dir[i];
+        }
+    }
+
+    float t_entry = std::max(std::max(t0[0], t0[1]), t0[2]);
+    float t_exit = std::min(std::min(t1[0], t1[1]), t1[2]);
+    return !(miss || t_entry > t_exit || t_exit < 0.0f || t_entry > 1.0f);
+}
+
+void OctreeGeometry::node_interval(const TraversalRay &ray, const OctreeKey &key, const size_t depth, float t0[3], float t1[3]) const
+{
+    const uint32_t keys[3] = {key.x, key.y, key.z};
+    const float root_min[3] = {min_corner.x, min_corner.y, min_corner.z};
+    const uint32_t last = (1u << depth) - 1;
+    const float cell = node_size(depth);
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (ray.parallel[i])
+        {
+            t0[i] = -infinity;
+            t1[i] = infinity;
+            continue;
+        }
+        // The cell's bounds in the mirrored frame
+        uint32_t k = (ray.mirror & (1 << i)) ? last - keys[i] : keys[i];
+        float min = root_min[i] + static_cast<float>(k) * cell;
+        t0[i] = (min - ray.origin[i]) * ray.inv_dir[i];
+        t1[i] = (min + cell - ray.origin[i]) * ray.inv_dir[i];
+    }
+}
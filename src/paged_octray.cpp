@@ -0,0 +1,410 @@
+#include "paged_octray.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+PagedOctray::PagedOctray(const std::string &_page_path, const Vec3f &_center, const float _size, const size_t _max_depth, const size_t _page_depth,
+                         const size_t _cache_bytes)
+    : page_path(_page_path), max_depth(_max_depth), page_depth(_page_depth), cache_bytes(_cache_bytes), top(_center, _size, _page_depth)
+{
+    if (max_depth > Octray::MAX_DEPTH_LIMIT)
+        throw std::invalid_argument("PagedOctray max_depth exceeds Octray::MAX_DEPTH_LIMIT");
+    if (page_depth > max_depth)
+        throw std::invalid_argument("PagedOctray page_depth exceeds max_depth");
+    set_occupancy_params(occupancy);
+
+    page_file.open(page_path, std::ios::binary | std::ios::trunc);
+    reader.open(page_path, std::ios::binary);
+    prefetch_reader.open(page_path, std::ios::binary);
+    if (!page_file || !reader || !prefetch_reader)
+        throw std::runtime_error("PagedOctray could not create " + page_path);
+    io_thread = std::thread([this]
+                            { io_loop(); });
+}
+
+PagedOctray::~PagedOctray()
+{
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        stopping = true;
+    }
+    io_wake.notify_one();
+    io_thread.join();
+    page_file.close();
+    std::remove(page_path.c_str());
+}
+
+void PagedOctray::set_occupancy_params(const Octray::OccupancyParams &params)
+{
+    if (!(params.clamp_min < 0.0f && params.clamp_max > 0.0f))
+        throw std::invalid_argument("PagedOctray occupancy clamp range must contain 0");
+    if (!(params.hit > 0.0f && params.miss < 0.0f))
+        throw std::invalid_argument("PagedOctray occupancy hit must be positive and miss negative");
+    occupancy = params;
+
+    // Aggregates are copied up as they are, so the top tree never clamps or prunes them
+    Octray::OccupancyParams summary = params;
+    summary.clamp_min = -std::numeric_limits<float>::infinity();
+    summary.clamp_max = std::numeric_limits<float>::infinity();
+    top.set_occupancy_params(summary);
+    for (auto &entry : resident)
+        entry.second.tree->set_occupancy_params(params);
+}
+
+void PagedOctray::accumulate_ray(const Vec3f &ray_start, const Vec3f &ray_end)
+{
+    std::vector<OctreeKey> keys;
+    top.cells_on_segment(ray_start, ray_end, page_depth, keys);
+    for (const OctreeKey &key : keys)
+    {
+        Octray *tree = find_page(key, true);
+        tree->accumulate_ray(ray_start, ray_end);
+        page_updated(key.morton_code());
+        if (!tree->is_leaf() || tree->get_log_odds() != 0.0f)
+        {
+            const uint64_t code = key.morton_code();
+            const float log_odds = tree->get_log_odds();
+            top.assign_leaves(&code, &log_odds, 1);
+        }
+    }
+
+    // The page the ray would reach next is likely the next to be updated
+    const Vec3f direction = ray_end - ray_start;
+    const float length = direction.magnitude();
+    OctreeKey ahead;
+    if (length > 0.0f && top.key_at(ray_end + direction * (top.node_size(page_depth) / length), page_depth, ahead))
+        prefetch(ahead);
+}
+
+void PagedOctray::accumulate_rays(const RaySegment *rays, const size_t count)
+{
+    // Each ray is listed under every page it crosses, then pages are updated in code order
+    struct Entry
+    {
+        uint64_t code;
+        OctreeKey key;
+        uint32_t ray;
+    };
+    std::vector<Entry> entries;
+    std::vector<OctreeKey> keys;
+    for (size_t r = 0; r < count; r++)
+    {
+        top.cells_on_segment(rays[r].start, rays[r].end, page_depth, keys);
+        for (const OctreeKey &key : keys)
+            entries.push_back({key.morton_code(), key, static_cast<uint32_t>(r)});
+    }
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b)
+                     { return a.code < b.code; });
+
+    std::vector<size_t> firsts; // each page's first entry, then the end
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (i == 0 || entries[i].code != entries[i - 1].code)
+            firsts.push_back(i);
+    }
+    firsts.push_back(entries.size());
+    const size_t page_count = firsts.size() - 1;
+
+    std::vector<RaySegment> segments;
+    std::vector<uint64_t> codes;
+    std::vector<float> values;
+    size_t next_prefetch = 1;
+    for (size_t p = 0; p < page_count; p++)
+    {
+        // Pages coming up are read in the background while this one is updated
+        for (; next_prefetch < std::min(page_count, p + 1 + PREFETCH_PAGES); next_prefetch++)
+            prefetch(entries[firsts[next_prefetch]].key);
+
+        segments.clear();
+        for (size_t i = firsts[p]; i < firsts[p + 1]; i++)
+            segments.push_back(rays[entries[i].ray]);
+
+        const Entry &first = entries[firsts[p]];
+        Octray *tree = find_page(first.key, true);
+        tree->accumulate_rays(segments.data(), segments.size());
+        if (!tree->is_leaf() || tree->get_log_odds() != 0.0f)
+        {
+            codes.push_back(first.code);
+            values.push_back(tree->get_log_odds());
+        }
+        page_updated(first.code);
+    }
+    top.assign_leaves(codes.data(), values.data(), codes.size());
+}
+
+const OctrayNode *PagedOctray::search(const Vec3f &point, const size_t query_depth)
+{
+    if (query_depth <= page_depth)
+        return top.search(point, query_depth);
+
+    OctreeKey key;
+    if (!top.key_at(point, page_depth, key))
+        return nullptr;
+    Octray *tree = find_page(key, false);
+    return tree ? tree->search(point, query_depth - page_depth) : nullptr;
+}
+
+bool PagedOctray::cast_ray(const Vec3f &origin, const Vec3f &direction, const float max_range, Octray::RayHit &hit, const size_t query_depth)
+{
+    if (query_depth <= page_depth)
+        return top.cast_ray(origin, direction, max_range, hit, query_depth);
+
+    const float length = direction.magnitude();
+    if (!(length > 0.0f && max_range > 0.0f))
+        return false;
+
+    // Pages front to back, skipping those with no occupied leaf without loading them
+    std::vector<OctreeKey> keys;
+    top.cells_on_segment(origin, origin + direction * (max_range / length), page_depth, keys);
+    for (const OctreeKey &key : keys)
+    {
+        const OctrayNode *summary = top.search(top.node_center(key, page_depth), page_depth);
+        if (!summary || !is_occupied(*summary))
+            continue;
+        Octray *tree = find_page(key, false);
+        if (tree && tree->cast_ray(origin, direction, max_range, hit, query_depth - page_depth))
+        {
+            hit.key = global_key(key, hit.key, hit.depth);
+            hit.depth += page_depth;
+            return true;
+        }
+    }
+    return false;
+}
+
+PagedOctray::PageStats PagedOctray::page_stats() const
+{
+    PageStats stats;
+    stats.resident = resident.size();
+    stats.resident_bytes = resident_bytes;
+    stats.loads = loads;
+    stats.evictions = evictions;
+
+    std::lock_guard<std::mutex> lock(io_mutex);
+    stats.prefetch_hits = prefetch_hits;
+    stats.writes = writes;
+    stats.file_bytes = file_bytes;
+    return stats;
+}
+
+Octray *PagedOctray::find_page(const OctreeKey &key, const bool create)
+{
+    const uint64_t code = key.morton_code();
+    auto found = resident.find(code);
+    if (found != resident.end())
+    {
+        lru.splice(lru.begin(), lru, found->second.lru);
+        return found->second.tree.get();
+    }
+
+    std::unique_ptr<Octray> tree = load(code);
+    if (!tree)
+    {
+        if (!create)
+            return nullptr;
+        tree = std::make_unique<Octray>(top.node_center(key, page_depth), top.node_size(page_depth), max_depth - page_depth);
+    }
+    tree->set_occupancy_params(occupancy);
+
+    lru.push_front(code);
+    Page &page = resident[code];
+    page.tree = std::move(tree);
+    page.bytes = page.tree->bytes_reserved();
+    page.lru = lru.begin();
+    resident_bytes += page.bytes;
+    shrink_cache(code);
+    return page.tree.get();
+}
+
+std::unique_ptr<Octray> PagedOctray::load(const uint64_t code)
+{
+    std::shared_ptr<const std::string> queued;
+    std::string image;
+    Extent extent{};
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        if (io_error)
+            std::rethrow_exception(io_error);
+
+        auto fetched = prefetched.find(code);
+        auto pending_image = pending.find(code);
+        auto stored = index.find(code);
+        if (pending_image != pending.end())
+        {
+            // Newer than anything in the file
+            queued = pending_image->second;
+        }
+        else if (stored != index.end())
+        {
+            extent = stored->second;
+            if (fetched != prefetched.end() && fetched->second.version == extent.version)
+            {
+                image.swap(fetched->second.image);
+                prefetch_hits++;
+            }
+        }
+        else
+        {
+            return nullptr;
+        }
+        if (fetched != prefetched.end())
+            prefetched.erase(fetched);
+    }
+
+    if (!queued && image.empty())
+        read_extent(reader, extent, image);
+    loads++;
+    std::istringstream in(queued ? *queued : image);
+    return Octray::read(in);
+}
+
+void PagedOctray::page_updated(const uint64_t code)
+{
+    Page &page = resident.at(code);
+    page.dirty = true;
+    const size_t bytes = page.tree->bytes_reserved();
+    resident_bytes = resident_bytes - page.bytes + bytes;
+    page.bytes = bytes;
+    shrink_cache(code);
+}
+
+void PagedOctray::shrink_cache(const uint64_t keep)
+{
+    while (resident_bytes > cache_bytes && resident.size() > 1 && lru.back() != keep)
+    {
+        auto found = resident.find(lru.back());
+        if (found->second.dirty)
+            write_back(found->first, *found->second.tree);
+        resident_bytes -= found->second.bytes;
+        lru.pop_back();
+        resident.erase(found);
+        evictions++;
+    }
+}
+
+void PagedOctray::write_back(const uint64_t code, const Octray &tree)
+{
+    std::ostringstream out;
+    tree.write(out);
+    auto image = std::make_shared<const std::string>(out.str());
+
+    std::unique_lock<std::mutex> lock(io_mutex);
+    // Images waiting to be written are capped like the cache, so a slow disk holds up updates
+    // rather than filling memory
+    io_progress.wait(lock, [&]
+                     { return pending_bytes <= cache_bytes || io_error; });
+    if (io_error)
+        std::rethrow_exception(io_error);
+    pending[code] = image;
+    pending_bytes += image->size();
+    requests.push_back({code, std::move(image)});
+    io_wake.notify_one();
+}
+
+void PagedOctray::prefetch(const OctreeKey &key)
+{
+    const uint64_t code = key.morton_code();
+    if (resident.count(code))
+        return;
+    std::lock_guard<std::mutex> lock(io_mutex);
+    if (!index.count(code) || pending.count(code) || prefetched.count(code))
+        return;
+    requests.push_back({code, nullptr});
+    io_wake.notify_one();
+}
+
+void PagedOctray::io_loop()
+{
+    std::unique_lock<std::mutex> lock(io_mutex);
+    while (true)
+    {
+        io_wake.wait(lock, [&]
+                     { return stopping || !requests.empty(); });
+        // Whatever is still queued is dropped with the file
+        if (stopping)
+            return;
+
+        IoRequest request = std::move(requests.front());
+        requests.pop_front();
+        try
+        {
+            if (request.image)
+            {
+                const std::string &image = *request.image;
+                const uint64_t slot = slot_bytes(image.size());
+                std::vector<uint64_t> &free = free_slots[slot];
+                uint64_t offset = file_bytes;
+                if (free.empty())
+                {
+                    file_bytes += slot;
+                }
+                else
+                {
+                    offset = free.back();
+                    free.pop_back();
+                }
+                lock.unlock();
+                page_file.seekp(static_cast<std::streamoff>(offset));
+                page_file.write(image.data(), static_cast<std::streamsize>(image.size()));
+                page_file.flush();
+                lock.lock();
+                if (!page_file)
+                    throw std::runtime_error("PagedOctray could not write to " + page_path);
+
+                // Loads read the file only once the image is in the index. The page's previous
+                // slot is free from then on: a load reads the file only with no image pending.
+                Extent &extent = index[request.code];
+                if (extent.bytes)
+                    free_slots[slot_bytes(extent.bytes)].push_back(extent.offset);
+                extent = {offset, image.size(), ++writes};
+                pending_bytes -= image.size();
+                auto queued = pending.find(request.code);
+                if (queued != pending.end() && queued->second == request.image)
+                    pending.erase(queued);
+            }
+            else
+            {
+                // Pages written again or loaded since the request are skipped
+                auto stored = index.find(request.code);
+                if (stored != index.end() && !pending.count(request.code) && !prefetched.count(request.code))
+                {
+                    const Extent extent = stored->second;
+                    lock.unlock();
+                    std::string image;
+                    read_extent(prefetch_reader, extent, image);
+                    lock.lock();
+
+                    prefetched[request.code] = {extent.version, std::move(image), ++prefetch_sequence};
+                    prefetch_order.emplace_back(request.code, prefetch_sequence);
+                    while (prefetch_order.size() > MAX_PREFETCHED)
+                    {
+                        auto oldest = prefetched.find(prefetch_order.front().first);
+                        if (oldest != prefetched.end() && oldest->second.sequence == prefetch_order.front().second)
+                            prefetched.erase(oldest);
+                        prefetch_order.pop_front();
+                    }
+                }
+            }
+        }
+        catch (...)
+        {
+            if (!lock.owns_lock())
+                lock.lock();
+            io_error = std::current_exception();
+        }
+        io_progress.notify_all();
+    }
+}
+
+void PagedOctray::read_extent(std::ifstream &in, const Extent &extent, std::string &image) const
+{
+    image.resize(extent.bytes);
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(extent.offset));
+    in.read(&image[0], static_cast<std::streamsize>(extent.bytes));
+    if (!in)
+        throw std::runtime_error("PagedOctray could not read a page from " + page_path);
+}
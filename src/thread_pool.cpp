@@ -0,0 +1,103 @@
+#include "thread_pool.hpp"
+
+ThreadPool::ThreadPool(size_t thread_count)
+{
+    if (thread_count == 0)
+        thread_count = std::thread::hardware_concurrency();
+    if (thread_count == 0)
+        thread_count = 1;
+
+    for (size_t i = 0; i < thread_count; i++)
+        queues.push_back(std::make_unique<WorkQueue>());
+    for (size_t i = 0; i < thread_count; i++)
+        workers.emplace_back(&ThreadPool::worker_loop, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cv.notify_all();
+    for (std::thread &worker : workers)
+        worker.join();
+}
+
+size_t ThreadPool::parallel_for(size_t count, const std::function<void(size_t, size_t)> &task)
+{
+    if (count == 0)
+        return 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        WorkQueue &queue = *queues[i % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(i);
+    }
+
+    size_t steals_before = steals.load();
+    std::unique_lock<std::mutex> lock(mutex);
+    current_task = &task;
+    busy_workers = workers.size();
+    generation++;
+    start_cv.notify_all();
+    done_cv.wait(lock, [this]
+                 { return busy_workers == 0; });
+    current_task = nullptr;
+    return steals.load() - steals_before;
+}
+
+void ThreadPool::worker_loop(size_t worker)
+{
+    size_t seen_generation = 0;
+    while (true)
+    {
+        const std::function<void(size_t, size_t)> *task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [&]
+                          { return stopping || generation != seen_generation; });
+            if (stopping)
+                return;
+            seen_generation = generation;
+            task = current_task;
+        }
+
+        size_t index;
+        while (pop_task(worker, index))
+            (*task)(index, worker);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy_workers == 0)
+            done_cv.notify_all();
+    }
+}
+
+bool ThreadPool::pop_task(size_t worker, size_t &task)
+{
+    {
+        WorkQueue &own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+
+    for (size_t offset = 1; offset < queues.size(); offset++)
+    {
+        WorkQueue &victim = *queues[(worker + offset) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            steals++;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,1233 @@
+#include "brick_grid.hpp"
+#include "frozen_octray.hpp"
+#include "instance_slots.hpp"
+#include "mapped_octray.hpp"
+#include "octray_node.hpp"
+#include "octray_stats.hpp"
+#include "paged_octray.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// Behaviour checks, one ctest case per function. Run with a test name to run only that one.
+
+#define CHECK(condition)                                                                         \
+    do                                                                                           \
+    {                                                                                            \
+        if (!(condition))                                                                        \
+        {                                                                                        \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++;                                                                          \
+        }                                                                                        \
+    } while (0)
+
+namespace
+{
+    int failures = 0;
+
+    constexpr size_t DEPTH = 7;
+    const Vec3f CENTER{0.0f, 0.0f, 0.0f};
+    constexpr float SIZE = 16.0f;
+
+    // Scans from a few sensor positions: long and short rays, some ending outside the octree,
+    // and some along the axes to exercise the parallel cases
+    std::vector<RaySegment> make_rays(const unsigned seed, const size_t count)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        std::uniform_real_distribution<float> range(0.5f, 11.0f);
+        std::vector<RaySegment> rays;
+        for (size_t i = 0; i < count; i++)
+        {
+            const size_t scan = i * 4 / count;
+            const Vec3f origin{-4.0f + 2.5f * scan, 1.5f - scan, 0.25f * scan};
+            Vec3f direction{unit(rng), unit(rng), 0.5f * unit(rng)};
+            if (i % 17 == 0)
+                direction = i % 2 ? Vec3f{1.0f, 0.0f, 0.0f} : Vec3f{0.0f, -1.0f, 0.0f};
+            rays.push_back({origin, origin + direction * (range(rng) / direction.magnitude())});
+        }
+        return rays;
+    }
+
+    std::vector<Vec3f> make_points(const unsigned seed, const size_t count)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> coordinate(-0.6f * SIZE, 0.6f * SIZE);
+        std::vector<Vec3f> points;
+        for (size_t i = 0; i < count; i++)
+            points.push_back({coordinate(rng), coordinate(rng), 0.25f * coordinate(rng)});
+        return points;
+    }
+
+    using Leaf = std::tuple<uint64_t, size_t, float>;
+
+    // Every leaf, max depth or pruned, as morton code of its key, depth and log odds
+    std::vector<Leaf> leaves(const Octray &octray)
+    {
+        std::vector<Leaf> result;
+        const Vec3f half{SIZE, SIZE, SIZE};
+        octray.query_box(CENTER - half, CENTER + half, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                         { result.emplace_back(key.morton_code(), depth, node.get_log_odds()); });
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    std::unique_ptr<Octray> build(const std::vector<RaySegment> &rays)
+    {
+        auto octray = std::make_unique<Octray>(CENTER, SIZE, DEPTH);
+        octray->accumulate_rays(rays.data(), rays.size());
+        return octray;
+    }
+
+    void accumulate_paths()
+    {
+        const std::vector<RaySegment> rays = make_rays(1, 4000);
+        Octray serial(CENTER, SIZE, DEPTH);
+        for (const RaySegment &ray : rays)
+            serial.accumulate_ray(ray.start, ray.end);
+        Octray packet(CENTER, SIZE, DEPTH);
+        packet.accumulate_rays(rays.data(), rays.size());
+        Octray threaded(CENTER, SIZE, DEPTH);
+        ThreadPool pool(4);
+        for (size_t batch = 0; batch < rays.size(); batch += 500)
+            threaded.accumulate_rays(rays.data() + batch, std::min<size_t>(500, rays.size() - batch), pool);
+
+        const std::vector<Leaf> expected = leaves(serial);
+        CHECK(!expected.empty());
+        CHECK(leaves(packet) == expected);
+        CHECK(leaves(threaded) == expected);
+        CHECK(threaded.bytes_in_use() == serial.bytes_in_use());
+    }
+
+    using LeafHit = std::tuple<uint64_t, size_t, int>;
+
+    // Max depth leaves a traversal reports, with their IntersectionType
+    struct LeafCollector : OctrayVisitor
+    {
+        std::vector<LeafHit> hits;
+
+        void on_leaf(const OctreeKey &key, const size_t depth, const int intersection) { hits.emplace_back(key.morton_code(), depth, intersection); }
+    };
+
+    // Brute force: every max depth leaf Octray::intersects reports for the segment
+    std::vector<LeafHit> intersected_leaves(const Octray &octray, const Vec3f &start, const Vec3f &end)
+    {
+        std::vector<LeafHit> result;
+        const size_t depth = octray.get_max_depth();
+        const uint32_t side = 1u << depth;
+        for (uint32_t x = 0; x < side; x++)
+        {
+            for (uint32_t y = 0; y < side; y++)
+            {
+                for (uint32_t z = 0; z < side; z++)
+                {
+                    const OctreeKey key{x, y, z};
+                    const int intersection = octray.intersects(key, depth, start, end);
+                    if (intersection != Octray::NO_INTERSECTION)
+                        result.emplace_back(key.morton_code(), depth, intersection);
+                }
+            }
+        }
+        std::sort(result.begin(), result.end());
+        return result;
+    }
+
+    // Segments along one axis that drift by less than the parallel threshold along another,
+    // in both signs, crossing the tree on either side of the mid-planes
+    std::vector<RaySegment> make_near_parallel_rays()
+    {
+        std::vector<RaySegment> rays;
+        for (int along = 0; along < 3; along++)
+        {
+            for (int drift = 0; drift < 3; drift++)
+            {
+                if (drift == along)
+                    continue;
+                for (float side : {0.3f, 0.7f})
+                {
+                    for (float offset : {0.0f, 5e-7f, -5e-7f})
+                    {
+                        for (float sign : {1.0f, -1.0f})
+                        {
+                            float start[3] = {0.55f, 0.55f, 0.55f};
+                            start[drift] = side;
+                            start[along] = sign > 0.0f ? 0.05f : 0.95f;
+                            float end[3] = {start[0], start[1], start[2]};
+                            end[along] += sign * 0.9f;
+                            end[drift] += offset;
+                            rays.push_back({{start[0], start[1], start[2]}, {end[0], end[1], end[2]}});
+                        }
+                    }
+                }
+            }
+        }
+        return rays;
+    }
+
+    void near_parallel_rays_match_intersects()
+    {
+        const Vec3f center{0.5f, 0.5f, 0.5f};
+        const std::vector<RaySegment> rays = make_near_parallel_rays();
+        for (const RaySegment &ray : rays)
+        {
+            Octray octray(center, 1.0f, 4);
+            LeafCollector collector;
+            octray.accumulate_ray(ray.start, ray.end, collector);
+            std::sort(collector.hits.begin(), collector.hits.end());
+            const std::vector<LeafHit> expected = intersected_leaves(octray, ray.start, ray.end);
+            CHECK(expected.size() == 16);
+            CHECK(collector.hits == expected);
+        }
+    }
+
+    // The bench's axis aligned and degenerate distributions over a unit tree at the origin: long
+    // rays along x, y or z in either sign, each also drifting by less than the parallel threshold,
+    // and zero length rays or ones entirely outside the tree
+    std::vector<RaySegment> make_bench_rays(const unsigned seed, const size_t count)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> inside(-0.5f, 0.5f);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        std::vector<RaySegment> rays;
+        for (size_t i = 0; i < count; i++)
+        {
+            Vec3f start{inside(rng), inside(rng), inside(rng)};
+            Vec3f end = start;
+            const float length = (unit(rng) < 0.5f ? -1.0f : 1.0f) * (0.3f + 0.6f * unit(rng));
+            const int axis = static_cast<int>(i % 3);
+            (axis == 0 ? end.x : axis == 1 ? end.y : end.z) += length;
+            rays.push_back({start, end});
+            (axis == 0 ? end.y : axis == 1 ? end.z : end.x) += i % 2 ? 5e-7f : -5e-7f;
+            rays.push_back({start, end});
+
+            start = {inside(rng), inside(rng), inside(rng)};
+            end = start;
+            if (i % 2)
+            {
+                start.x += 2.0f;
+                end = start + Vec3f{unit(rng), unit(rng), unit(rng)} * 0.2f;
+            }
+            rays.push_back({start, end});
+        }
+        return rays;
+    }
+
+    void packet_matches_scalar()
+    {
+        const std::vector<RaySegment> rays = make_bench_rays(40, 1500);
+        const Vec3f origin{0.0f, 0.0f, 0.0f};
+        Octray serial(origin, 1.0f, 8);
+        LeafCollector serial_hits;
+        for (const RaySegment &ray : rays)
+            serial.accumulate_ray(ray.start, ray.end, serial_hits);
+        Octray packet(origin, 1.0f, 8);
+        LeafCollector packet_hits;
+        for (size_t i = 0; i < rays.size(); i += Octray::PACKET_WIDTH)
+            packet.accumulate_ray_packet<Octray::PACKET_WIDTH>(rays.data() + i, std::min(Octray::PACKET_WIDTH, rays.size() - i), packet_hits);
+        Octray threaded(origin, 1.0f, 8);
+        ThreadPool pool(4);
+        threaded.accumulate_rays(rays.data(), rays.size(), pool);
+
+        std::sort(serial_hits.hits.begin(), serial_hits.hits.end());
+        std::sort(packet_hits.hits.begin(), packet_hits.hits.end());
+        CHECK(!serial_hits.hits.empty());
+        CHECK(packet_hits.hits == serial_hits.hits);
+        const std::vector<Leaf> expected = leaves(serial);
+        CHECK(leaves(packet) == expected);
+        CHECK(leaves(threaded) == expected);
+    }
+
+    void insert_scan_splits_free_and_occupied()
+    {
+        const Vec3f center{0.5f, 0.5f, 0.5f};
+        const Octray::OccupancyParams params;
+        const float cell = 1.0f / 16.0f;
+
+        // Points ending exactly on a cell face end in the cell above it, whichever way the ray
+        // runs, and the cells before it are free
+        for (float sign : {1.0f, -1.0f})
+        {
+            Octray octray(center, 1.0f, 4);
+            const Vec3f origin{sign > 0.0f ? 0.5f * cell : 1.0f - 0.5f * cell, 8.5f * cell, 8.5f * cell};
+            const Vec3f point{8.0f * cell, 8.5f * cell, 8.5f * cell};
+            octray.insert_scan(origin, &point, 1);
+            std::vector<Leaf> expected;
+            for (uint32_t x = sign > 0.0f ? 0 : 8; x < (sign > 0.0f ? 9u : 16u); x++)
+                expected.emplace_back(OctreeKey{x, 8, 8}.morton_code(), 4, x == 8 ? params.hit : params.miss);
+            std::sort(expected.begin(), expected.end());
+            CHECK(leaves(octray) == expected);
+        }
+
+        // A fan of rays from one origin: every leaf is updated once, as a hit where a point ends
+        // and as a miss where only rays pass, even where many rays cross it
+        Octray octray(center, 1.0f, 4);
+        std::mt19937 rng(17);
+        std::uniform_real_distribution<float> coordinate(0.02f, 0.98f);
+        const Vec3f origin{0.1f, 0.45f, 0.5f};
+        std::vector<Vec3f> points;
+        for (int i = 0; i < 300; i++)
+            points.push_back({coordinate(rng), coordinate(rng), coordinate(rng)});
+        octray.insert_scan(origin, points.data(), points.size());
+
+        std::set<uint64_t> end_cells;
+        for (const Vec3f &point : points)
+            end_cells.insert(OctreeKey{static_cast<uint32_t>(point.x * 16.0f), static_cast<uint32_t>(point.y * 16.0f), static_cast<uint32_t>(point.z * 16.0f)}.morton_code());
+        size_t hits = 0, misses = 0;
+        octray.query_box(Vec3f{0.0f, 0.0f, 0.0f}, Vec3f{1.0f, 1.0f, 1.0f}, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                         {
+            CHECK(depth == 4);
+            if (end_cells.count(key.morton_code()))
+            {
+                CHECK(node.get_log_odds() == params.hit);
+                hits++;
+                return;
+            }
+            CHECK(node.get_log_odds() == params.miss);
+            CHECK(std::any_of(points.begin(), points.end(), [&](const Vec3f &point)
+                              { return octray.intersects(key, depth, origin, point) != Octray::NO_INTERSECTION; }));
+            misses++; });
+        CHECK(hits == end_cells.size());
+        CHECK(misses > end_cells.size());
+
+        // Every sample along a ray, clear of the cell faces, lies in an updated cell
+        for (const Vec3f &point : points)
+        {
+            for (int step = 1; step < 64; step++)
+            {
+                const Vec3f sample = origin + (point - origin) * (step / 64.0f);
+                const float offsets[3] = {sample.x * 16.0f, sample.y * 16.0f, sample.z * 16.0f};
+                bool near_face = false;
+                for (float offset : offsets)
+                    near_face |= std::abs(offset - std::round(offset)) < 1e-3f;
+                if (!near_face)
+                    CHECK(octray.search(sample) != nullptr);
+            }
+        }
+    }
+
+    void search_matches_query_points()
+    {
+        const auto octray = build(make_rays(2, 3000));
+        const std::vector<Vec3f> points = make_points(3, 5000);
+        std::vector<const OctrayNode *> results(points.size());
+        for (size_t query_depth : {size_t{0}, size_t{3}, DEPTH})
+        {
+            octray->query_points(points.data(), points.size(), results.data(), query_depth);
+            size_t found = 0;
+            for (size_t i = 0; i < points.size(); i++)
+            {
+                CHECK(results[i] == octray->search(points[i], query_depth));
+                found += results[i] != nullptr;
+            }
+            CHECK(found > 0);
+        }
+    }
+
+    void file_round_trip()
+    {
+        Octray octray(CENTER, SIZE, DEPTH);
+        Octray::OccupancyParams params;
+        params.hit = 0.9f;
+        params.clamp_max = 3.0f;
+        octray.set_occupancy_params(params);
+        const std::vector<RaySegment> rays = make_rays(4, 3000);
+        octray.accumulate_rays(rays.data(), rays.size());
+
+        std::stringstream file;
+        octray.write(file);
+        const auto loaded = Octray::read(file);
+        CHECK(loaded->get_max_depth() == DEPTH);
+        CHECK(loaded->get_occupancy_params().hit == params.hit);
+        CHECK(loaded->get_occupancy_params().clamp_max == params.clamp_max);
+        CHECK(leaves(*loaded) == leaves(octray));
+
+        // A file cut short is rejected
+        std::stringstream truncated(file.str().substr(0, file.str().size() - 3));
+        bool threw = false;
+        try
+        {
+            Octray::read(truncated);
+        }
+        catch (const std::runtime_error &)
+        {
+            threw = true;
+        }
+        CHECK(threw);
+    }
+
+    void other_layouts_match()
+    {
+        const std::vector<RaySegment> rays = make_rays(5, 4000);
+        const auto octray = build(rays);
+        const std::string path = "octray_tests_map.oct";
+        octray->write(path);
+        MappedOctray mapped(path);
+        const auto frozen = octray->freeze();
+        CHECK(frozen->node_count() == octray->subtree_size());
+
+        const std::vector<Vec3f> points = make_points(6, 5000);
+        for (size_t query_depth : {size_t{0}, size_t{2}, size_t{5}, DEPTH})
+        {
+            for (const Vec3f &point : points)
+            {
+                const OctrayNode *node = octray->search(point, query_depth);
+                MappedOctray::Node mapped_node;
+                FrozenOctray::Node frozen_node;
+                const bool in_mapped = mapped.search(point, mapped_node, query_depth);
+                const bool in_frozen = frozen->search(point, frozen_node, query_depth);
+                CHECK(in_mapped == (node != nullptr));
+                CHECK(in_frozen == (node != nullptr));
+                if (node && in_mapped && in_frozen)
+                {
+                    CHECK(mapped_node.log_odds == node->get_log_odds());
+                    CHECK(frozen_node.log_odds == node->get_log_odds());
+                    CHECK(mapped_node.depth == frozen_node.depth);
+                    CHECK(mapped_node.key.morton_code() == frozen_node.key.morton_code());
+                }
+            }
+        }
+
+        std::mt19937 rng(7);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        size_t hits = 0;
+        for (int i = 0; i < 2000; i++)
+        {
+            const Vec3f origin{2.0f * unit(rng), 2.0f * unit(rng), 0.5f * unit(rng)};
+            const Vec3f direction{unit(rng), unit(rng), 0.3f * unit(rng)};
+            Octray::RayHit tree_hit, frozen_hit;
+            const bool tree_found = octray->cast_ray(origin, direction, 20.0f, tree_hit);
+            const bool frozen_found = frozen->cast_ray(origin, direction, 20.0f, frozen_hit);
+            CHECK(tree_found == frozen_found);
+            if (tree_found && frozen_found)
+            {
+                CHECK(tree_hit.key.morton_code() == frozen_hit.key.morton_code());
+                CHECK(tree_hit.depth == frozen_hit.depth);
+                CHECK(tree_hit.distance == frozen_hit.distance);
+            }
+            hits += tree_found;
+        }
+        CHECK(hits > 0);
+        std::remove(path.c_str());
+
+        // Pages hold the same cells; pruning stops at page boundaries, so only cell values are
+        // compared, at cell centers clear of the faces rays could round across
+        PagedOctray paged("octray_tests_pages.bin", CENTER, SIZE, DEPTH, 3, size_t{1} << 20);
+        paged.accumulate_rays(rays.data(), rays.size());
+        std::mt19937 cells(8);
+        std::uniform_int_distribution<uint32_t> cell(0, (1u << DEPTH) - 1);
+        size_t known = 0;
+        for (int i = 0; i < 5000; i++)
+        {
+            const Vec3f point = octray->node_center(OctreeKey{cell(cells), cell(cells), cell(cells)}, DEPTH);
+            const OctrayNode *node = octray->search(point);
+            const OctrayNode *paged_node = paged.search(point);
+            CHECK((node != nullptr) == (paged_node != nullptr));
+            if (node && paged_node)
+                CHECK(node->get_log_odds() == paged_node->get_log_odds());
+            known += node != nullptr;
+        }
+        CHECK(known > 0);
+        CHECK(paged.page_stats().evictions > 0);
+    }
+
+    struct OccupiedBox
+    {
+        uint64_t code;
+        size_t depth;
+        Vec3f min, max;
+    };
+
+    // Every occupied leaf, max depth or pruned, of a layout with query_box
+    template <typename Layout>
+    std::vector<OccupiedBox> occupied_boxes(Layout &layout, const Octray &geometry)
+    {
+        std::vector<OccupiedBox> boxes;
+        const Vec3f half{SIZE, SIZE, SIZE};
+        layout.query_box(CENTER - half, CENTER + half, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                         {
+            if (!layout.is_occupied(node))
+                return;
+            const Vec3f center = geometry.node_center(key, depth);
+            const float half_size = 0.5f * geometry.node_size(depth);
+            const Vec3f corner{half_size, half_size, half_size};
+            boxes.push_back({key.morton_code(), depth, center - corner, center + corner}); });
+        return boxes;
+    }
+
+    struct ReferenceHit
+    {
+        const OccupiedBox *box = nullptr;
+        double entry = 2.0;      // segment parameter the ray enters the box at, 0 if it starts inside
+        double next_entry = 2.0; // the same for the next box along the ray
+    };
+
+    // Brute force first hit: a slab test of the segment against every occupied box, in double
+    ReferenceHit reference_cast(const std::vector<OccupiedBox> &boxes, const Vec3f &start, const Vec3f &end)
+    {
+        ReferenceHit result;
+        for (const OccupiedBox &box : boxes)
+        {
+            double t_min = 0.0, t_max = 1.0;
+            bool crossed = true;
+            for (int i = 0; i < 3 && crossed; i++)
+            {
+                const double d = static_cast<double>(end[i]) - start[i];
+                if (std::abs(d) < 1e-6)
+                {
+                    crossed = start[i] >= box.min[i] && start[i] <= box.max[i];
+                    continue;
+                }
+                double t0 = (box.min[i] - static_cast<double>(start[i])) / d;
+                double t1 = (box.max[i] - static_cast<double>(start[i])) / d;
+                if (t0 > t1)
+                    std::swap(t0, t1);
+                t_min = std::max(t_min, t0);
+                t_max = std::min(t_max, t1);
+                crossed = t_min <= t_max;
+            }
+            if (!crossed)
+                continue;
+            if (t_min < result.entry)
+            {
+                result.next_entry = result.entry;
+                result.entry = t_min;
+                result.box = &box;
+            }
+            else
+                result.next_entry = std::min(result.next_entry, t_min);
+        }
+        return result;
+    }
+
+    // Axis aligned rays in both signs, the same drifting under and over the parallel threshold
+    // along the other axes, and rays in any direction
+    std::vector<std::pair<Vec3f, Vec3f>> make_casts(const unsigned seed, const size_t count)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> position(-6.0f, 6.0f);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        std::vector<std::pair<Vec3f, Vec3f>> casts;
+        for (size_t i = 0; i < count; i++)
+        {
+            const Vec3f origin{position(rng), position(rng), 0.25f * position(rng)};
+            Vec3f direction{0.0f, 0.0f, 0.0f};
+            const int axis = static_cast<int>(i % 3);
+            (axis == 0 ? direction.x : axis == 1 ? direction.y : direction.z) = i % 2 ? 1.0f : -1.0f;
+            casts.emplace_back(origin, direction);
+            for (float drift : {2e-8f, 1e-4f})
+            {
+                Vec3f drifted = direction;
+                drifted.x += unit(rng) < 0.0f ? -drift : drift;
+                drifted.y += unit(rng) < 0.0f ? -drift : drift;
+                drifted.z += unit(rng) < 0.0f ? -drift : drift;
+                casts.emplace_back(origin, drifted);
+            }
+            casts.emplace_back(origin, Vec3f{unit(rng), unit(rng), unit(rng)});
+        }
+        return casts;
+    }
+
+    template <typename Layout>
+    void check_casts(Layout &layout, const Octray &geometry, const std::vector<std::pair<Vec3f, Vec3f>> &casts)
+    {
+        constexpr float max_range = 20.0f;
+        const std::vector<OccupiedBox> boxes = occupied_boxes(layout, geometry);
+        CHECK(!boxes.empty());
+        size_t hits = 0;
+        for (const auto &[origin, direction] : casts)
+        {
+            const Vec3f end = origin + direction * (max_range / direction.magnitude());
+            const ReferenceHit expected = reference_cast(boxes, origin, end);
+            Octray::RayHit hit;
+            const bool found = layout.cast_ray(origin, direction, max_range, hit);
+            CHECK(found == (expected.box != nullptr));
+            if (!found || !expected.box)
+                continue;
+            hits++;
+            CHECK(std::abs(hit.distance - expected.entry * max_range) < 1e-3);
+            // Boxes entered at the same point, through a shared edge or corner, are either a fair hit
+            if (expected.next_entry - expected.entry > 1e-4)
+            {
+                CHECK(hit.key.morton_code() == expected.box->code);
+                CHECK(hit.depth == expected.box->depth);
+            }
+        }
+        CHECK(hits > 0);
+    }
+
+    void cast_ray_matches_brute_force()
+    {
+        const std::vector<RaySegment> rays = make_rays(12, 4000);
+        const auto octray = build(rays);
+        const std::vector<std::pair<Vec3f, Vec3f>> casts = make_casts(13, 1500);
+        check_casts(*octray, *octray, casts);
+
+        const auto frozen = octray->freeze();
+        Octray::RayHit tree_hit, frozen_hit;
+        for (const auto &[origin, direction] : casts)
+        {
+            const bool tree_found = octray->cast_ray(origin, direction, 20.0f, tree_hit);
+            CHECK(frozen->cast_ray(origin, direction, 20.0f, frozen_hit) == tree_found);
+            if (tree_found)
+            {
+                CHECK(frozen_hit.key.morton_code() == tree_hit.key.morton_code());
+                CHECK(frozen_hit.distance == tree_hit.distance);
+            }
+        }
+
+        PagedOctray paged("octray_tests_cast_pages.bin", CENTER, SIZE, DEPTH, 3, size_t{1} << 20);
+        paged.accumulate_rays(rays.data(), rays.size());
+        check_casts(paged, *octray, casts);
+    }
+
+    // Length of the segment inside a max depth cell, in cells
+    double length_in_cell(const Octray &octray, const OctreeKey &key, const Vec3f &start, const Vec3f &end)
+    {
+        const size_t depth = octray.get_max_depth();
+        const Vec3f center = octray.node_center(key, depth);
+        const double half = 0.5 * octray.node_size(depth);
+        double t_min = 0.0, t_max = 1.0;
+        for (int i = 0; i < 3; i++)
+        {
+            const double d = static_cast<double>(end[i]) - start[i];
+            const double low = center[i] - half - static_cast<double>(start[i]);
+            const double high = center[i] + half - static_cast<double>(start[i]);
+            if (d == 0.0)
+            {
+                if (low > 0.0 || high < 0.0)
+                    return 0.0;
+                continue;
+            }
+            t_min = std::max(t_min, std::min(low / d, high / d));
+            t_max = std::min(t_max, std::max(low / d, high / d));
+        }
+        const double length = (end - start).magnitude() / octray.node_size(depth);
+        return std::max(0.0, t_max - t_min) * length;
+    }
+
+    void brick_grid_matches_octray()
+    {
+        // Ray by ray, the DDA updates the cells the descent does, the same way. The descent also
+        // updates cells the segment only grazes at an edge or corner, which the 6-connected walk
+        // leaves out, and rounding may put an end point on either side of a face.
+        // Sensor positions off the cell faces, unlike make_rays, so segments rarely start on one
+        std::mt19937 rng(18);
+        std::uniform_real_distribution<float> coordinate(-7.0f, 7.0f);
+        std::vector<RaySegment> rays;
+        for (int i = 0; i < 3000; i++)
+        {
+            const Vec3f start{coordinate(rng), coordinate(rng), 0.5f * coordinate(rng)};
+            Vec3f end{coordinate(rng), coordinate(rng), 0.5f * coordinate(rng)};
+            if (i % 13 == 0)
+                end = {start.x, start.y, end.z};
+            rays.push_back({start, end});
+        }
+        Octray octray(CENTER, SIZE, DEPTH);
+        BrickGrid grid(CENTER, SIZE, DEPTH);
+        std::vector<RaySegment> clean;
+        for (const RaySegment &ray : rays)
+        {
+            LeafCollector tree_hits, grid_hits;
+            octray.accumulate_ray(ray.start, ray.end, tree_hits);
+            grid.accumulate_ray(ray.start, ray.end, grid_hits);
+            std::sort(tree_hits.hits.begin(), tree_hits.hits.end());
+            std::sort(grid_hits.hits.begin(), grid_hits.hits.end());
+            if (tree_hits.hits == grid_hits.hits)
+            {
+                clean.push_back(ray);
+                continue;
+            }
+            std::vector<LeafHit> differing;
+            std::set_symmetric_difference(tree_hits.hits.begin(), tree_hits.hits.end(), grid_hits.hits.begin(), grid_hits.hits.end(), std::back_inserter(differing));
+            const size_t side = size_t{1} << DEPTH;
+            for (const auto &[code, depth, intersection] : differing)
+            {
+                // Decoded by brute force, the test tree has few enough cells
+                OctreeKey key{};
+                for (uint32_t x = 0; x < side; x++)
+                {
+                    for (uint32_t y = 0; y < side; y++)
+                    {
+                        for (uint32_t z = 0; z < side; z++)
+                        {
+                            if (OctreeKey{x, y, z}.morton_code() == code)
+                                key = {x, y, z};
+                        }
+                    }
+                }
+                const bool grazed = length_in_cell(octray, key, ray.start, ray.end) < 1e-3;
+                OctreeKey end_key;
+                const bool end_on_face = octray.key_at(ray.end, DEPTH, end_key) && length_in_cell(octray, end_key, ray.start, ray.end) < 1e-3;
+                CHECK(grazed || end_on_face || intersection == Octray::END_POINT_INSIDE);
+            }
+        }
+        CHECK(clean.size() > rays.size() * 99 / 100);
+
+        // Built from the rays that agree, the grid holds exactly the tree's leaves
+        Octray tree(CENTER, SIZE, DEPTH);
+        BrickGrid walked(CENTER, SIZE, DEPTH);
+        for (int round = 0; round < 3; round++)
+        {
+            tree.accumulate_rays(clean.data(), clean.size());
+            walked.accumulate_rays(clean.data(), clean.size());
+        }
+        CHECK(leaves(*walked.to_octray()) == leaves(tree));
+    }
+
+    void brick_grid_round_trips()
+    {
+        // Repeated rays saturate their free cells, so siblings are pruned above max depth
+        Octray octray(CENTER, SIZE, DEPTH);
+        const std::vector<RaySegment> rays = make_rays(19, 1500);
+        for (int round = 0; round < 6; round++)
+            octray.accumulate_rays(rays.data(), rays.size());
+        const std::vector<Leaf> expected = leaves(octray);
+        CHECK(std::any_of(expected.begin(), expected.end(), [](const Leaf &leaf)
+                          { return std::get<1>(leaf) < DEPTH; }));
+
+        // A pruned node becomes every cell it covers
+        size_t cells = 0;
+        for (const Leaf &leaf : expected)
+            cells += size_t{1} << (3 * (DEPTH - std::get<1>(leaf)));
+        const BrickGrid grid(octray);
+        CHECK(grid.cell_count() == cells);
+        CHECK(grid.get_occupancy_params().clamp_min == octray.get_occupancy_params().clamp_min);
+        CHECK(leaves(*grid.to_octray()) == expected);
+
+        bool threw = false;
+        try
+        {
+            BrickGrid capped(octray, cells - 1);
+        }
+        catch (const std::length_error &)
+        {
+            threw = true;
+        }
+        CHECK(threw);
+    }
+
+    void merge_matches_single_tree()
+    {
+        // Exactly representable updates and a clamp range nothing reaches, so sums are exact
+        // whatever order they are taken in
+        Octray::OccupancyParams params;
+        params.hit = 1.0f;
+        params.miss = -0.5f;
+        params.clamp_min = -1000.0f;
+        params.clamp_max = 1000.0f;
+        auto make_tree = [&]()
+        {
+            auto tree = std::make_unique<Octray>(CENTER, SIZE, DEPTH);
+            tree->set_occupancy_params(params);
+            return tree;
+        };
+
+        const std::vector<RaySegment> rays = make_rays(21, 5000);
+        const auto single = make_tree();
+        single->accumulate_rays(rays.data(), rays.size());
+        const std::vector<Leaf> expected = leaves(*single);
+
+        // The rays split into disjoint batches, a tree each
+        auto make_batches = [&](const size_t count)
+        {
+            std::vector<std::unique_ptr<Octray>> trees;
+            for (size_t b = 0; b < count; b++)
+            {
+                trees.push_back(make_tree());
+                const size_t begin = rays.size() * b / count, end = rays.size() * (b + 1) / count;
+                trees.back()->accumulate_rays(rays.data() + begin, end - begin);
+            }
+            return trees;
+        };
+
+        ThreadPool pool(3);
+        for (size_t count : {size_t{2}, size_t{5}})
+        {
+            const auto copied = make_tree();
+            for (const auto &tree : make_batches(count))
+                copied->merge(*tree);
+            CHECK(leaves(*copied) == expected);
+
+            const auto taken = make_tree();
+            for (const auto &tree : make_batches(count))
+                taken->merge(std::move(*tree));
+            CHECK(leaves(*taken) == expected);
+
+            std::vector<std::unique_ptr<Octray>> trees = make_batches(count);
+            Octray::merge_all(trees, pool);
+            CHECK(trees.size() == 1);
+            CHECK(leaves(*trees[0]) == expected);
+        }
+    }
+
+    void merge_all_rejects_mismatched_trees()
+    {
+        const std::vector<RaySegment> rays = make_rays(14, 1000);
+        ThreadPool pool(2);
+        for (int mismatch = 0; mismatch < 2; mismatch++)
+        {
+            std::vector<std::unique_ptr<Octray>> trees;
+            for (int i = 0; i < 4; i++)
+                trees.push_back(build(rays));
+            if (mismatch)
+                trees[3] = std::make_unique<Octray>(CENTER, SIZE, DEPTH - 1);
+            else
+                trees[3].reset();
+            const std::vector<Leaf> before = leaves(*trees[0]);
+
+            // Thrown on the calling thread, before any tree is touched
+            bool threw = false;
+            try
+            {
+                Octray::merge_all(trees, pool);
+            }
+            catch (const std::invalid_argument &)
+            {
+                threw = true;
+            }
+            CHECK(threw);
+            CHECK(trees.size() == 4);
+            CHECK(leaves(*trees[0]) == before);
+        }
+    }
+
+    // Short rays within a cube of side 3.5 around x = -6, -2, 2 or 6, so regions never share a cell
+    std::vector<RaySegment> make_region_rays(const int region, const unsigned seed, const size_t count)
+    {
+        std::mt19937 rng(seed);
+        std::uniform_real_distribution<float> offset(-0.75f, 0.75f);
+        std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+        const Vec3f center{-6.0f + 4.0f * region, 0.0f, 0.0f};
+        std::vector<RaySegment> rays;
+        for (size_t i = 0; i < count; i++)
+        {
+            const Vec3f start = center + Vec3f{offset(rng), offset(rng), offset(rng)};
+            const Vec3f direction{unit(rng), unit(rng), unit(rng)};
+            rays.push_back({start, start + direction * (0.5f * std::abs(unit(rng)) / direction.magnitude())});
+        }
+        return rays;
+    }
+
+    void memory_budget_collapses_stale_subtrees()
+    {
+        Octray unbounded(CENTER, SIZE, DEPTH);
+        std::vector<std::vector<RaySegment>> batches;
+        for (int region = 0; region < 4; region++)
+            batches.push_back(make_region_rays(region, 22 + region, 1500));
+        unbounded.accumulate_rays(batches[0].data(), batches[0].size());
+        const size_t budget = unbounded.bytes_in_use() * 5 / 2;
+
+        Octray bounded(CENTER, SIZE, DEPTH);
+        bounded.set_memory_budget(budget);
+        for (size_t b = 0; b < batches.size(); b++)
+        {
+            if (b)
+                unbounded.accumulate_rays(batches[b].data(), batches[b].size());
+            bounded.accumulate_rays(batches[b].data(), batches[b].size());
+            CHECK(bounded.bytes_in_use() <= budget);
+        }
+        CHECK(unbounded.bytes_in_use() > budget);
+        CHECK(bounded.bytes_reserved() < unbounded.bytes_reserved());
+
+        // The latest batch's region is kept cell for cell
+        const Vec3f corner{1.75f, 1.75f, 1.75f};
+        auto region_leaves = [&](const Octray &octray, const int region)
+        {
+            std::vector<Leaf> result;
+            const Vec3f center{-6.0f + 4.0f * region, 0.0f, 0.0f};
+            octray.query_box(center - corner, center + corner, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                             { result.emplace_back(key.morton_code(), depth, node.get_log_odds()); });
+            std::sort(result.begin(), result.end());
+            return result;
+        };
+        CHECK(region_leaves(bounded, 3) == region_leaves(unbounded, 3));
+
+        // The first is collapsed, each collapsed node holding the max of the leaves it replaced
+        size_t collapsed = 0;
+        const Vec3f first{-6.0f, 0.0f, 0.0f};
+        bounded.query_box(first - corner, first + corner, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                          {
+            if (depth == DEPTH)
+                return;
+            const Vec3f center = bounded.node_center(key, depth);
+            const float inset = 0.49f * bounded.node_size(depth);
+            float max_log_odds = -INFINITY;
+            unbounded.query_box(center - Vec3f{inset, inset, inset}, center + Vec3f{inset, inset, inset}, [&](const OctrayNode &leaf, const OctreeKey &, const size_t)
+                                { max_log_odds = std::max(max_log_odds, leaf.get_log_odds()); });
+            CHECK(node.get_log_odds() == max_log_odds);
+            collapsed++; });
+        CHECK(collapsed > 0);
+    }
+
+    void snapshot_keeps_version()
+    {
+        Octray octray(CENTER, SIZE, DEPTH);
+        const std::vector<RaySegment> first = make_rays(9, 2000);
+        octray.accumulate_rays(first.data(), first.size());
+        octray.publish();
+
+        Octray::Snapshot snapshot = octray.snapshot();
+        const uint64_t version = snapshot.version();
+        const std::vector<Vec3f> points = make_points(10, 3000);
+        std::vector<float> before;
+        for (const Vec3f &point : points)
+        {
+            const OctrayNode *node = snapshot.search(point);
+            before.push_back(node ? node->get_log_odds() : NAN);
+        }
+
+        // Later writes, published or not, leave the snapshot as it was
+        for (unsigned round = 0; round < 3; round++)
+        {
+            const std::vector<RaySegment> more = make_rays(11 + round, 2000);
+            octray.accumulate_rays(more.data(), more.size());
+            octray.publish();
+        }
+        size_t changed = 0;
+        for (size_t i = 0; i < points.size(); i++)
+        {
+            const OctrayNode *node = snapshot.search(points[i]);
+            const float now = node ? node->get_log_odds() : NAN;
+            CHECK(std::memcmp(&now, &before[i], sizeof(float)) == 0);
+            const OctrayNode *latest = octray.search(points[i]);
+            changed += !latest || latest->get_log_odds() != now;
+        }
+        CHECK(snapshot.version() == version);
+        CHECK(changed > 0);
+
+        // Move assignment hands the old version's slot back
+        snapshot = octray.snapshot();
+        CHECK(snapshot.version() == version + 3);
+        for (const Vec3f &point : points)
+        {
+            const OctrayNode *node = snapshot.search(point);
+            const OctrayNode *latest = octray.search(point);
+            CHECK((node != nullptr) == (latest != nullptr));
+            if (node && latest)
+                CHECK(node->get_log_odds() == latest->get_log_odds());
+        }
+    }
+
+    void snapshot_keeps_occupancy_params()
+    {
+        Octray octray(CENTER, SIZE, DEPTH);
+        const std::vector<RaySegment> rays = make_rays(15, 2000);
+        octray.accumulate_rays(rays.data(), rays.size());
+        octray.publish();
+        const Octray::Snapshot before = octray.snapshot();
+
+        // A threshold above clamp_max leaves nothing occupied, but only from the next publish
+        Octray::OccupancyParams params = octray.get_occupancy_params();
+        params.occupied_threshold = 10.0f;
+        octray.set_occupancy_params(params);
+        const Octray::Snapshot unpublished = octray.snapshot();
+        octray.publish();
+        const Octray::Snapshot after = octray.snapshot();
+        CHECK(before.get_occupancy_params().occupied_threshold == 0.0f);
+        CHECK(unpublished.get_occupancy_params().occupied_threshold == 0.0f);
+        CHECK(after.get_occupancy_params().occupied_threshold == 10.0f);
+
+        size_t before_hits = 0;
+        for (const auto &[origin, direction] : make_casts(16, 200))
+        {
+            Octray::RayHit hit;
+            before_hits += before.cast_ray(origin, direction, 20.0f, hit);
+            CHECK(!after.cast_ray(origin, direction, 20.0f, hit));
+            CHECK(!octray.cast_ray(origin, direction, 20.0f, hit));
+        }
+        CHECK(before_hits > 0);
+
+        // Readers copy whole parameter sets while the writer keeps replacing them
+        std::atomic<bool> done{false};
+        std::atomic<size_t> torn{0};
+        std::thread reader([&]()
+                           {
+            while (!done.load())
+            {
+                const Octray::Snapshot snapshot = octray.snapshot();
+                const Octray::OccupancyParams &seen = snapshot.get_occupancy_params();
+                torn += (seen.occupied_threshold == 10.0f) != (seen.clamp_max == 3.5f);
+                Octray::RayHit hit;
+                snapshot.cast_ray(rays[0].start, rays[0].end - rays[0].start, 20.0f, hit);
+            } });
+        for (int round = 0; round < 200; round++)
+        {
+            params.occupied_threshold = round % 2 ? 10.0f : 0.5f;
+            params.clamp_max = round % 2 ? 3.5f : 3.0f;
+            octray.set_occupancy_params(params);
+            octray.publish();
+        }
+        done.store(true);
+        reader.join();
+        CHECK(torn.load() == 0);
+    }
+
+    void instance_slots_mirror_tree()
+    {
+        struct Instance
+        {
+            uint64_t code;
+            size_t depth;
+            float log_odds;
+            bool drawn;
+        };
+        InstanceSlots<Instance> slots(Instance{0, 0, 0.0f, false});
+        auto make = [](const OctrayNode &node, const OctreeKey &key, const size_t depth, Instance &instance)
+        {
+            instance = {key.morton_code(), depth, node.get_log_odds(), true};
+            return true;
+        };
+
+        Octray octray(CENTER, SIZE, DEPTH);
+        for (unsigned round = 0; round < 4; round++)
+        {
+            const std::vector<RaySegment> rays = make_rays(20 + round, 1500);
+            octray.accumulate_rays(rays.data(), rays.size());
+            slots.update(octray, make);
+            slots.flush([](size_t, size_t) {});
+
+            std::vector<Leaf> drawn;
+            for (const Instance &instance : slots.instances())
+            {
+                if (instance.drawn)
+                    drawn.emplace_back(instance.code, instance.depth, instance.log_odds);
+            }
+            std::sort(drawn.begin(), drawn.end());
+            CHECK(drawn == leaves(octray));
+            CHECK(slots.drawn_count() == drawn.size());
+        }
+    }
+
+    // Column major view and projection, as glm::lookAt and glm::perspective build them
+    void camera(const float eye[3], const float target[3], float view[16], float projection[16])
+    {
+        float f[3], s[3], u[3];
+        for (int i = 0; i < 3; i++)
+            f[i] = target[i] - eye[i];
+        const float f_length = std::sqrt(f[0] * f[0] + f[1] * f[1] + f[2] * f[2]);
+        for (float &c : f)
+            c /= f_length;
+        // Right is forward cross up, with up along z
+        s[0] = f[1];
+        s[1] = -f[0];
+        s[2] = 0.0f;
+        const float s_length = std::sqrt(s[0] * s[0] + s[1] * s[1]);
+        for (float &c : s)
+            c /= s_length;
+        u[0] = s[1] * f[2] - s[2] * f[1];
+        u[1] = s[2] * f[0] - s[0] * f[2];
+        u[2] = s[0] * f[1] - s[1] * f[0];
+
+        std::fill(view, view + 16, 0.0f);
+        for (int i = 0; i < 3; i++)
+        {
+            view[4 * i] = s[i];
+            view[4 * i + 1] = u[i];
+            view[4 * i + 2] = -f[i];
+        }
+        view[12] = -(s[0] * eye[0] + s[1] * eye[1] + s[2] * eye[2]);
+        view[13] = -(u[0] * eye[0] + u[1] * eye[1] + u[2] * eye[2]);
+        view[14] = f[0] * eye[0] + f[1] * eye[1] + f[2] * eye[2];
+        view[15] = 1.0f;
+
+        const float near = 0.5f, far = 40.0f, aspect = 4.0f / 3.0f;
+        const float tan_half_fov = std::tan(0.5f * 1.0f);
+        std::fill(projection, projection + 16, 0.0f);
+        projection[0] = 1.0f / (aspect * tan_half_fov);
+        projection[5] = 1.0f / tan_half_fov;
+        projection[10] = -(far + near) / (far - near);
+        projection[11] = -1.0f;
+        projection[14] = -2.0f * far * near / (far - near);
+    }
+
+    // Brute force: a box is out of view if all 8 corners fail one clip test, -w <= x, y, z <= w
+    bool box_in_view(const float view[16], const float projection[16], const Vec3f &center, const float half)
+    {
+        int outside[6] = {};
+        for (int corner = 0; corner < 8; corner++)
+        {
+            const float point[4] = {center.x + (corner & 1 ? half : -half), center.y + (corner & 2 ? half : -half),
+                                    center.z + (corner & 4 ? half : -half), 1.0f};
+            float eye[4] = {}, clip[4] = {};
+            for (int r = 0; r < 4; r++)
+            {
+                for (int k = 0; k < 4; k++)
+                    eye[r] += view[4 * k + r] * point[k];
+            }
+            for (int r = 0; r < 4; r++)
+            {
+                for (int k = 0; k < 4; k++)
+                    clip[r] += projection[4 * k + r] * eye[k];
+            }
+            for (int axis = 0; axis < 3; axis++)
+            {
+                outside[2 * axis] += clip[axis] < -clip[3];
+                outside[2 * axis + 1] += clip[axis] > clip[3];
+            }
+        }
+        return std::none_of(std::begin(outside), std::end(outside), [](int count)
+                            { return count == 8; });
+    }
+
+    void query_view_matches_frustum()
+    {
+        const auto octray = build(make_rays(30, 4000));
+        const float eye[3] = {-12.0f, -3.0f, 4.0f};
+        const float target[3] = {2.0f, 1.0f, 0.0f};
+        float view[16], projection[16];
+        camera(eye, target, view, projection);
+        const float viewport_height = 600.0f;
+        const ViewFrustum frustum(view, projection, viewport_height);
+
+        // With no pixel threshold, exactly the leaves in view
+        std::vector<Leaf> in_view;
+        std::vector<std::pair<OctreeKey, size_t>> keys_in_view;
+        size_t leaf_count = 0;
+        const Vec3f half{SIZE, SIZE, SIZE};
+        octray->query_box(CENTER - half, CENTER + half, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                          {
+            leaf_count++;
+            if (!box_in_view(view, projection, octray->node_center(key, depth), 0.5f * octray->node_size(depth)))
+                return;
+            in_view.emplace_back(key.morton_code(), depth, node.get_log_odds());
+            keys_in_view.emplace_back(key, depth); });
+        std::sort(in_view.begin(), in_view.end());
+        std::vector<Leaf> visited;
+        octray->query_view(frustum, 0.0f, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                           { visited.emplace_back(key.morton_code(), depth, node.get_log_odds()); });
+        std::sort(visited.begin(), visited.end());
+        CHECK(!in_view.empty());
+        CHECK(in_view.size() < leaf_count);
+        CHECK(visited == in_view);
+
+        // With one, every leaf in view lies in exactly one visited node, each in view and either
+        // a leaf, at max depth, or smaller on screen than the threshold
+        const float min_pixels = 12.0f;
+        std::set<std::pair<uint64_t, size_t>> coarse;
+        octray->query_view(frustum, min_pixels, [&](const OctrayNode &node, const OctreeKey &key, const size_t depth)
+                           {
+            const Vec3f center = octray->node_center(key, depth);
+            CHECK(box_in_view(view, projection, center, 0.5f * octray->node_size(depth)));
+            CHECK(node.is_leaf() || depth == DEPTH || frustum.projected_size(center, octray->node_size(depth)) < min_pixels);
+            coarse.emplace(key.morton_code(), depth); });
+        CHECK(coarse.size() < in_view.size());
+        for (const auto &[key, depth] : keys_in_view)
+        {
+            size_t covering = 0;
+            for (size_t ancestor = 0; ancestor <= depth; ancestor++)
+                covering += coarse.count({key.ancestor(static_cast<int>(depth - ancestor)).morton_code(), ancestor});
+            CHECK(covering == 1);
+        }
+    }
+
+    // Checks whichever way the build is configured, OCTRAY_ENABLE_STATS on or off
+    void stats_follow_configuration()
+    {
+        OctrayStats::reset();
+        {
+            Octray octray(CENTER, SIZE, DEPTH);
+            const std::vector<RaySegment> rays = make_rays(26, 3000);
+            ThreadPool pool(2);
+            octray.accumulate_rays(rays.data(), rays.size(), pool);
+            octray.accumulate_rays(rays.data(), rays.size());
+            octray.publish();
+            Octray::RayHit hit;
+            octray.cast_ray(rays[0].start, rays[0].end - rays[0].start, 20.0f, hit);
+
+            const OctrayStats::Totals totals = OctrayStats::collect();
+            if (OctrayStats::ENABLED)
+            {
+                // Worker threads' counts are included
+                CHECK(totals.counters[OctrayStats::NODES_VISITED] > 0);
+                CHECK(totals.counters[OctrayStats::CHILD_INTERVAL_TESTS] > 0);
+                CHECK(totals.counters[OctrayStats::LEAF_UPDATES] > 0);
+                CHECK(totals.counters[OctrayStats::BLOCKS_ALLOCATED] > 0);
+                CHECK(totals.maximums[OctrayStats::MAX_TRAVERSAL_DEPTH] == DEPTH);
+                CHECK(totals.timer_calls[OctrayStats::TIME_ACCUMULATE_RAYS] == 2);
+                CHECK(totals.timer_calls[OctrayStats::TIME_PUBLISH] == 1);
+                CHECK(totals.gauges[OctrayStats::BYTES_IN_USE] >= static_cast<int64_t>(octray.bytes_in_use()));
+            }
+            else
+            {
+                CHECK(std::all_of(std::begin(totals.counters), std::end(totals.counters), [](uint64_t n)
+                                  { return n == 0; }));
+                CHECK(std::all_of(std::begin(totals.gauges), std::end(totals.gauges), [](int64_t n)
+                                  { return n == 0; }));
+                CHECK(totals.maximums[OctrayStats::MAX_TRAVERSAL_DEPTH] == 0);
+                CHECK(totals.timer_calls[OctrayStats::TIME_ACCUMULATE_RAYS] == 0);
+            }
+        }
+
+        // Disabled, the macros expand to nothing: their arguments are neither compiled nor run
+        int evaluated = 0;
+#if !OCTRAY_ENABLE_STATS
+        OCTRAY_COUNT(NOT_A_COUNTER, evaluated++);
+        OCTRAY_GAUGE_ADD(NOT_A_GAUGE, evaluated++);
+        OCTRAY_MAX(NOT_A_MAXIMUM, evaluated++);
+        OCTRAY_TIME_SCOPE(NOT_A_TIMER);
+#else
+        OCTRAY_COUNT(PRUNES, ++evaluated);
+#endif
+        CHECK(evaluated == (OctrayStats::ENABLED ? 1 : 0));
+    }
+
+    struct Test
+    {
+        const char *name;
+        void (*run)();
+    };
+
+    const Test TESTS[] = {
+        {"accumulate_paths", accumulate_paths},
+        {"near_parallel_rays_match_intersects", near_parallel_rays_match_intersects},
+        {"packet_matches_scalar", packet_matches_scalar},
+        {"insert_scan_splits_free_and_occupied", insert_scan_splits_free_and_occupied},
+        {"search_matches_query_points", search_matches_query_points},
+        {"file_round_trip", file_round_trip},
+        {"other_layouts_match", other_layouts_match},
+        {"cast_ray_matches_brute_force", cast_ray_matches_brute_force},
+        {"brick_grid_matches_octray", brick_grid_matches_octray},
+        {"brick_grid_round_trips", brick_grid_round_trips},
+        {"merge_matches_single_tree", merge_matches_single_tree},
+        {"merge_all_rejects_mismatched_trees", merge_all_rejects_mismatched_trees},
+        {"memory_budget_collapses_stale_subtrees", memory_budget_collapses_stale_subtrees},
+        {"snapshot_keeps_version", snapshot_keeps_version},
+        {"snapshot_keeps_occupancy_params", snapshot_keeps_occupancy_params},
+        {"instance_slots_mirror_tree", instance_slots_mirror_tree},
+        {"query_view_matches_frustum", query_view_matches_frustum},
+        {"stats_follow_configuration", stats_follow_configuration},
+    };
+}
+
+int main(int argc, char **argv)
+{
+    bool ran = false;
+    for (const Test &test : TESTS)
+    {
+        if (argc > 1 && std::strcmp(argv[1], test.name) != 0)
+            continue;
+        const int before = failures;
+        test.run();
+        std::printf("%s %s\n", failures == before ? "pass" : "FAIL", test.name);
+        ran = true;
+    }
+    if (!ran)
+    {
+        std::fprintf(stderr, "no test named %s\n", argv[1]);
+        return 1;
+    }
+    return failures ? 1 : 0;
+}